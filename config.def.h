@@ -4,14 +4,71 @@ static char *progress       = "#FF0000";
 static char *progress_trust = "#00FF00";
 static char *stylefile      = ".surf/style.css";
 static char *scriptfile     = ".surf/script.js";
+static gboolean scriptmainframe = FALSE; /* no script in subframes */
 static char *cookiefile     = ".surf/cookies.txt";
 static char *dldir          = ".surf/dl";
+static int maxdownloads     = 4;    /* concurrent downloads */
+static int segments         = 4;    /* parallel ranges per download */
+
+/* bandwidth caps in bytes/s for NetDocument, NetSubresource, NetPrefetch
+ * and NetDownload requests, 0 is unlimited. busycaps apply while requests
+ * of a more important class are in flight. */
+static int netcaps[NetLast]  = { 0, 0, 0, 0 };
+static int busycaps[NetLast] = { 0, 0, 64 * 1024, 256 * 1024 };
 static time_t sessiontime   = 3600;
+static char *socketfile     = ".surf/socket";
+static gboolean singleinstance = FALSE; /* one process for all windows */
+static gboolean controlsocket = FALSE;  /* socketfile.pid in every process */
+static int zygotes          = 0;    /* warm processes for new windows */
+static int cookiecompact    = 1024; /* stale cookie journal entries */
+/* max-conns, max-conns-per-host, idle-timeout and timeout (s) of the
+ * libsoup session, 0 keeps the default of 10, 2, none and none */
+static int poollimits[4]    = { 0, 0, 0, 0 };
+static char *statsfile      = ".surf/stats"; /* written on SIGUSR1 */
+static int stalltime        = 100;  /* ms a main loop iteration may block */
+static int discardtime      = 0;    /* s unfocused before the page is freed, 0 never */
+static int hiddentimer      = 1000; /* ms between page timers of hidden windows */
+static gboolean hiddengc    = TRUE; /* collect script garbage when hidden */
+static int cachedwindows    = 4;    /* windows with full size caches */
+static long lowmemory       = 1024; /* MB of RAM needed for full caches */
+static char *pressurefile   = "/proc/pressure/memory"; /* or memory.events */
+static double pressurelimit = 10.0; /* % of time stalled on memory */
+static int pressureinterval = 5;    /* s between pressure checks, 0 never */
+static int pressurecooldown = 30;   /* s between cache flushes */
+static int hoverdelay       = 150;  /* ms on a link before its host is warmed */
+static gboolean preconnect  = TRUE; /* connect on hover, FALSE resolves only */
+static time_t warmtime      = 30;   /* s before a host is warmed again */
+static char *blockfile      = ".surf/blocklist"; /* hosts and uri patterns */
+static char *sitefile       = ".surf/sites"; /* settings per host */
+static char *sessiondir     = ".surf/session/"; /* a file per process */
+static gboolean sessions    = TRUE; /* keep windows for surf -r */
+static int restorejobs      = 1;    /* restored windows loading unfocused */
+static char *histfile       = ".surf/history"; /* visits, NULL keeps none */
+static long histrebuild     = 256 * 1024; /* log bytes before reindexing */
+static int histlimit        = 1000; /* uris surf -q prints */
+static int promptlines      = 10;   /* completions the prompt offers */
+static gboolean usedmenu    = FALSE; /* dmenu instead of the prompt */
+static char *cachedir       = ".surf/cache/";
+static long cachesize       = 64 * 1024 * 1024; /* bytes on disk, 0 no cache */
+static long cacheobject     = 512 * 1024; /* largest cached response */
+static long cachememory     = 8 * 1024 * 1024; /* bytes of entries in memory */
+static const char *cachetypes[] = { /* content types kept in the cache */
+	"image/", "text/css", "text/javascript", "application/javascript",
+	"application/x-javascript", "font/", "application/font-woff",
+	"application/x-font", "application/vnd.ms-fontobject",
+};
 
 #define SETPROP(p)       { .v = (char *[]){ "/bin/sh", "-c", \
 	"prop=\"`xprop -id $1 $0 | cut -d '\"' -f 2 | dmenu`\" &&" \
 	"xprop -id $1 -f $0 8s -set $0 \"$prop\"", \
 	p, winid, NULL } }
+#define SETURI(p)        { .v = (char *[]){ "/bin/sh", "-c", \
+	"prop=\"`{ xprop -id $1 $0 | cut -d '\"' -f 2; \"$2\" -q ''; } | dmenu`\" &&" \
+	"xprop -id $1 -f $0 8s -set $0 \"$prop\"", \
+	p, winid, progname, NULL } }
+static Arg dmenu[] = { /* by PromptUri and PromptFind */
+	SETURI("_SURF_URI"), SETPROP("_SURF_FIND"),
+};
 #define MODKEY GDK_CONTROL_MASK
 static Key keys[] = {
     /* modifier	            keyval      function    arg             Focus */
@@ -29,8 +86,8 @@ static Key keys[] = {
     { MODKEY,               GDK_k,      scroll,     { .i = -1 } },
     { 0,                    GDK_Escape, stop,       { 0 } },
     { MODKEY,               GDK_o,      source,     { 0 } },
-    { MODKEY,               GDK_g,      spawn,      SETPROP("_SURF_URI") },
-    { MODKEY,               GDK_slash,  spawn,      SETPROP("_SURF_FIND") },
+    { MODKEY,               GDK_g,      prompt,     { .i = PromptUri } },
+    { MODKEY,               GDK_slash,  prompt,     { .i = PromptFind } },
     { MODKEY,               GDK_n,      find,       { .b = TRUE } },
     { MODKEY|GDK_SHIFT_MASK,GDK_n,      find,       { .b = FALSE } },
 };
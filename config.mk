@@ -11,12 +11,17 @@ GTKINC=$(shell pkg-config --cflags gtk+-2.0 webkit-1.0)
 GTKLIB=$(shell pkg-config --libs gtk+-2.0 webkit-1.0)
 
 
+# benchmark corpus, one uri per line, and windows loading in parallel;
+# bench/corpus lists the pages in bench/
+BENCHURLS = bench/corpus
+BENCHJOBS = 4
+
 # includes and libs
 INCS = -I. -I/usr/include ${GTKINC}
 LIBS = -L/usr/lib -lc ${GTKLIB} -lgthread-2.0
 
 # flags
-CPPFLAGS = -DVERSION=\"${VERSION}\"
+CPPFLAGS = -DVERSION=\"${VERSION}\" -D_BSD_SOURCE -D_DEFAULT_SOURCE
 CFLAGS = -std=c99 -pedantic -Wall -Os ${INCS} ${CPPFLAGS}
 LDFLAGS = -s ${LIBS}
 
@@ -2,6 +2,8 @@
  *
  * To understand surf, start reading main().
  */
+#include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <X11/X.h>
 #include <X11/Xatom.h>
@@ -10,9 +12,17 @@
 #include <gdk/gdk.h>
 #include <gdk/gdkkeysyms.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <utime.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <webkit/webkit.h>
@@ -22,6 +32,14 @@
 #define LENGTH(x)               (sizeof x / sizeof x[0])
 #define CLEANMASK(mask)         (mask & ~(GDK_MOD2_MASK))
 
+enum { NetDocument, NetSubresource, NetPrefetch, NetDownload, NetLast }; /* request classes by priority */
+enum { ProbeKeypress, ProbeUpdate, ProbeIndicator, ProbeCookie, ProbeReload,
+	ProbeScript, ProbeX, ProbeBlock, ProbePrompt, ProbeLast }; /* timed handlers */
+enum { PromptUri, PromptFind };
+enum { CountCookieWrites, CountXRoundTrips, CountScripts, CountStalls,
+	CountFlushes, CountCacheHits, CountCacheMisses, CountCacheStores,
+	CountPreconnects, CountBlocked, CountLast };
+
 typedef union Arg Arg;
 union Arg {
 	gboolean b;
@@ -30,17 +48,137 @@ union Arg {
 };
 
 typedef struct Client {
-	GtkWidget *win, *scroll, *vbox, *indicator;
+	GtkWidget *win, *scroll, *vbox, *indicator, *prompt;
 	GtkWidget **items;
 	WebKitWebView *view;
-	WebKitDownload *download;
-	char *title, *linkhover;
-	const char *uri, *needle;
-	gint progress;
+	char *title, *linkhover, *wintitle;
+	char *uri, *needle;
+	gint progress, drawn;
+	guint updater;
+	GdkGC *gc;
+	gboolean trusted;
+	int bench;
+	gdouble benchstart;
+	gboolean focused, restorescroll, hidden, lazy;
+	time_t idle;
+	WebKitWebHistoryItem **hist;
+	int nhist, curhist;
+	gdouble scrollx, scrolly;
+	gfloat zoomlevel;
+	guint hoverer;
+	SoupMessage *speculation;
+	int promptmode;
+	gdouble prompted;
+	char *site;
+	char *histuri, *histtitle; /* the title last logged for histuri */
 	struct Client *next;
 	gboolean zoomed;
 } Client;
 
+typedef struct Segment {
+	struct Download *d;
+	SoupMessage *msg;
+	goffset start, pos, end;
+} Segment;
+
+typedef struct Download {
+	WebKitDownload *dl;
+	Client *c;
+	char *uri, *name, *file, *validator, *referer;
+	gulong handler;
+	int fd, nseg, running, ending;
+	Segment *seg;
+	goffset total, received;
+	GTimer *timer;
+	time_t saved;
+	gboolean ranges, failed;
+	struct Download *next;
+} Download;
+
+typedef struct {
+	char *path;
+	time_t mtime;
+	off_t size;
+} CacheEntry;
+
+enum { CachePreload, CachePrune, CacheRefresh, CacheStore, CacheTouch };
+
+typedef struct {
+	int job;
+	char *uri, *head;
+	time_t expires;
+	GByteArray *body;
+} CacheItem;
+
+/* requests per host and port and connections per remote address and
+ * port, dropped once no message or connection refers to it */
+typedef struct {
+	char *key;
+	int open, busy, queued, refs;
+	guint requests;
+} Pool;
+
+/* a connection of pool, busy with msg */
+typedef struct {
+	Pool *pool;
+	SoupMessage *msg;
+} Conn;
+
+/* compiled blocklist: a hash set of blocked hosts and an Aho-Corasick
+ * automaton of url patterns, transitions sorted by character per state */
+typedef struct {
+	char magic[8];
+	guint32 nhosts, hashsize, nstates, ntrans, poolsize;
+} BlockHeader;
+
+typedef struct {
+	guint32 first, n, fail, match;
+} BlockState;
+
+typedef struct {
+	guint32 c, next;
+} BlockTrans;
+
+/* site settings: a hash of host patterns, *.host stored as .host and *
+ * as ., each pattern followed by its settings in the pool */
+typedef struct {
+	char magic[8];
+	guint32 nsites, hashsize, poolsize;
+} SiteHeader;
+
+/* history index: entries sorted by key, the uri without scheme and
+ * www., then their positions by descending frecency at build time and
+ * the strings. Queries score the visits when they run. */
+typedef struct {
+	char magic[8];
+	guint32 n, poolsize;
+	guint64 logsize;
+} HistHeader;
+
+typedef struct {
+	guint32 key, uri, title, visits;
+	gint64 last;
+} HistEntry;
+
+typedef struct {
+	char *uri, *title;
+	guint visits;
+	time_t last;
+	float score;
+	guint32 pos;
+} HistItem;
+
+typedef struct {
+	const char *name;
+	gdouble ms;
+} Phase;
+
+typedef struct {
+	const char *name;
+	guint n, hist[12];
+	gdouble start, total, max;
+} Probe;
+
 typedef struct {
 	char *label;
 	void (*func)(Client *c, const Arg *arg);
@@ -54,341 +192,2647 @@ typedef struct {
 	const Arg arg;
 } Key;
 
+/* a compaction of the cookie journal: the first read bytes of inode ino
+ * became the first written bytes of newino */
+typedef struct {
+	ino_t ino, newino;
+	off_t read, written;
+} Compaction;
+
 static Display *dpy;
 static Atom uriprop, findprop;
+static GdkColor progresscolor, trustcolor;
 static SoupCookieJar *cookies;
 static SoupSession *session;
 static Client *clients = NULL;
+static Download *downloads = NULL;
+static GHashTable *documents;
+static GHashTable *pools, *sockets;
+static int netbusy[NetLast], nettokens[NetLast];
+static GSList *netpaused[NetLast];
+static guint nettimer = 0;
+static int benchjobs = 0, benchnext = 0, benchdone = 0, benchfailed = 0, benchn = 0;
+static char **benchuris = NULL;
+static char *benchdir = NULL;
+static gboolean blockbenchmode = FALSE;
+static gboolean histquerymode = FALSE;
+static gdouble *benchtimes[4];
+static GTimer *benchtimer;
 static GdkNativeWindow embed = 0;
 static gboolean showxid = FALSE;
 static int ignorexprop = 0;
 static char winid[64];
-static char *progname;
+static char progname[PATH_MAX]; /* how surf was run, for children */
 static gboolean lockcookie = FALSE;
+static ino_t cookieino = 0;
+static off_t cookieoff = 0;
+static int cookiestale = 0;
+static ino_t compactino = 0;
+static GThread *compacter = NULL;
+static int cookiereloads = 0, cookiesyncs = 0, cookieskips = 0;
+static int sock = -1;
+static char *sockpath = NULL;
+static gboolean single = FALSE;
+static int zygote = -1;
+static int *warm = NULL, nwarm = 0;
+static Probe probes[ProbeLast] = {
+	{ "keypress" }, { "update" }, { "drawindicator" }, { "changecookie" },
+	{ "reloadcookies" }, { "windowobjectcleared" }, { "processx" },
+	{ "blocklist" }, { "prompt" },
+};
+static const gdouble probelimits[] = { 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+	25, 50, 100 }; /* histogram bucket bounds in ms */
+static const char *countnames[CountLast] = {
+	"cookie writes", "x round trips", "script evaluations", "stalls",
+	"memory flushes", "cache hits", "cache misses", "cache stores",
+	"preconnects", "blocked requests",
+};
+static guint counts[CountLast];
+static GTimer *probeclock;
+static int slowest = -1;
+static gdouble slowesttime, loopwake = -1;
+static volatile sig_atomic_t dumprequested = 0;
+static char *pressurepath;
+static long pressureevents = -1;
+static time_t lastflush = 0;
+static off_t cachewritten;
+static GHashTable *cachemem;
+static long cachememused = 0;
+static GThreadPool *cachepool = NULL;
+static GHashTable *warmed;
+static BlockHeader *blockindex = NULL;
+static gsize blocksize;
+static guint32 *blockhosts;
+static BlockState *blockstates;
+static BlockTrans *blocktrans;
+static char *blockpool;
+static char *sessionpath = NULL;
+static guint64 sessionstart = 0;
+static GSList *restored = NULL;
+static gboolean quitting = FALSE;
+static guint sessioner = 0, trickler = 0;
+static guint dlwriter = 0;
+static gboolean restore = FALSE;
+static GThread *cookiereader = NULL;
+static gdouble cookieparsed;
+static int cookielines;
+static gboolean profile = FALSE, started = FALSE;
+static struct timeval starttime;
+static Phase phases[16];
+static int nphases = 0;
+static SiteHeader *siteindex = NULL;
+static gsize sitesize;
+static struct stat sitestat;
+static guint32 *sitehash;
+static char *sitepool;
+static HistHeader *histindex = NULL;
+static gsize histsize;
+static ino_t histino;
+static GHashTable *histitems = NULL;
+static GSList *histchunks = NULL;
+static off_t histlogfrom, histlogend;
+static ino_t histlogino;
+static volatile gint histbuilding = 0;
+static HistEntry *histentries;
+static guint32 *histranks;
+static char *histpool;
 
+static gboolean acceptcontrol(GIOChannel *s, GIOCondition cond, gpointer d);
+static void appendcookie(const char *line);
+static void benchload(Client *c);
+static void benchreport(void);
+static void benchstatus(WebKitWebView *v, GParamSpec *pspec, Client *c);
+static void blockbench(const char *corpus);
+static gboolean blocked(const char *uri);
+static guint32 blockgo(BlockState *st, BlockTrans *tr, guint32 s, guchar c);
+static guint32 blockhash(const char *s, gsize len);
+static gboolean blockhost(const char *host, gsize len);
+static char *blockrule(char *l);
+static gboolean buildblocklist(const char *src, const char *dst);
+static gboolean buildhistory(const char *src, const char *dst);
 static char *buildpath(const char *path);
+static gboolean buildsites(const char *src, const char *dst);
+static gboolean buttonpress(GtkWidget *w, GdkEventButton *ev, Client *c);
+static void cachechunk(SoupMessage *msg, SoupBuffer *chunk, gpointer d);
+static void cachefree(gpointer d);
+static time_t cachefresh(SoupMessage *msg);
+static void cacheheaders(SoupMessage *msg, gpointer d);
+static gboolean cachekeep(gpointer d);
+static void cacheline(const char *name, const char *value, gpointer d);
+static char *cachepath(const char *uri);
+static void cachepreload(void);
+static void cacheprune(void);
+static void cachequeue(int job, const char *uri, time_t expires);
+static gboolean cacheread(const char *path, CacheItem *it);
+static gboolean cacheserve(gpointer d);
+static gboolean cachestale(gpointer k, gpointer v, gpointer now);
+static void cachestore(SoupMessage *msg, GByteArray *body);
+static void cachework(gpointer data, gpointer d);
+static void cachewrite(const char *path, CacheItem *it);
+static void canceldownload(Download *d);
 static void changecookie(SoupCookieJar *jar, SoupCookie *o, SoupCookie *n, gpointer p);
 static void cleanup(void);
 static void clipboard(Client *c, const Arg *arg);
+static void closeprompt(Client *c);
+static int cmpdouble(const void *a, const void *b);
+static int cmphistkey(const void *a, const void *b);
+static int cmphistscore(const void *a, const void *b);
+static int cmpkey(const void *a, const void *b);
+static int cmpentry(const void *a, const void *b);
+static void compactcookies(void);
+static gboolean compactdone(gpointer d);
+static gpointer compactjournal(gpointer d);
+static void connidle(SoupMessage *msg);
 static void context(WebKitWebView *v, GtkMenu *m, Client *c);
+static char *control(char *cmd);
+static char *cookieline(SoupCookie *c, time_t expires);
 static char *copystr(char **str, const char *src);
+static void createpath(const char *apath);
 static WebKitWebView *createwindow(WebKitWebView *v, WebKitWebFrame *f, Client *c);
 static gboolean decidedownload(WebKitWebView *v, WebKitWebFrame *f, WebKitNetworkRequest *r, gchar *m,  WebKitWebPolicyDecision *p, Client *c);
+static gboolean decidenavigation(WebKitWebView *v, WebKitWebFrame *f, WebKitNetworkRequest *r, WebKitWebNavigationAction *n, WebKitWebPolicyDecision *p, Client *c);
 static gboolean decidewindow(WebKitWebView *v, WebKitWebFrame *f, WebKitNetworkRequest *r, WebKitWebNavigationAction *n, WebKitWebPolicyDecision *p, Client *c);
+static gboolean deferred(gpointer d);
 static void destroyclient(Client *c);
 static void destroywin(GtkWidget* w, Client *c);
 static void die(char *str);
+static void discardclient(Client *c);
+static gboolean discardidle(gpointer d);
+static void droprestored(void);
+static void dumpstats(FILE *f);
 static void download(Client *c, const Arg *arg);
+static char *downloadline(Download *d);
 static void drawindicator(Client *c);
+static void enddownload(Download *d);
+static char *expandpath(const char *path);
 static gboolean exposeindicator(GtkWidget *w, GdkEventExpose *e, Client *c);
+static void faildownload(Download *d);
+static gboolean fillpool(gpointer d);
 static void find(Client *c, const Arg *arg);
+static void flushmemory(const char *why);
+static gboolean focusin(GtkWidget *w, GdkEventFocus *e, Client *c);
+static gboolean focusout(GtkWidget *w, GdkEventFocus *e, Client *c);
 static const char *getatom(Client *c, Atom a);
+static Client *getclient(guint xid);
+static Pool *findpool(const char *host, guint port);
+static Pool *getpool(SoupMessage *msg);
+static JSValueRef gethidden(JSContextRef js, JSObjectRef o, JSStringRef name, JSValueRef *e);
 static char *geturi(Client *c);
+static void gotchunk(SoupMessage *msg, SoupBuffer *chunk, Segment *s);
+static void gotheaders(SoupMessage *msg, Segment *s);
+static gboolean governor(gpointer d);
+static void histadd(GHashTable *items, char *line);
+static gpointer histbuild(gpointer d);
+static void histfree(HistItem *items, int n);
+static const char *histkey(const char *uri);
+static GHashTable *histlog(void);
+static void histmap(gboolean rebuild);
+static int histopen(const char *path, int op);
+static HistItem *histquery(const char *q, int n, int *found);
+static void histrecord(const char *uri, const char *title);
+static float histscore(guint visits, time_t last, time_t now);
 static gboolean initdownload(WebKitWebView *v, WebKitDownload *o, Client *c);
+static void installcookies(GHashTable *live);
+static char *listdownloads(void);
+static char *listpools(void);
 static void itemclick(GtkMenuItem *mi, Client *c);
 static gboolean keypress(GtkWidget *w, GdkEventKey *ev, Client *c);
 static void linkhover(WebKitWebView *v, const char* t, const char* l, Client *c);
+static void loadblocklist(void);
 static void loadcommit(WebKitWebView *v, WebKitWebFrame *f, Client *c);
+static JSStringRef loadscript(void);
+static void loadsites(void);
 static void loadstart(WebKitWebView *v, WebKitWebFrame *f, Client *c);
 static void loaduri(Client *c, const Arg *arg);
+static gboolean loopcheck(GSource *src);
+static gboolean loopdispatch(GSource *src, GSourceFunc cb, gpointer d);
+static gboolean loopprepare(GSource *src, gint *timeout);
 static void navigate(Client *c, const Arg *arg);
-static Client *newclient(void);
+static int netcap(int cls);
+static Client *newclient(gboolean lazy);
+static void newview(Client *c);
 static void newwindow(Client *c, const Arg *arg);
+static int opencookies(void);
+static char *parkzygote(void);
+static SoupCookie *parsecookie(const char *line);
+static gpointer parsecookies(gpointer d);
 static void pasteuri(GtkClipboard *clipboard, const char *text, gpointer d);
+static void poolclosed(gpointer d, GObject *sock);
+static void poolfree(gpointer d);
+static void poolrelease(Pool *p);
 static void print(Client *c, const Arg *arg);
+static void probeadd(int p, gdouble ms);
+static void probebegin(int p);
+static void probeend(int p);
 static GdkFilterReturn processx(GdkXEvent *xevent, GdkEvent *event, gpointer d);
+static guint64 procstart(int pid);
+static void profilemark(const char *name, gdouble ms);
+static void profilereport(void);
+static gdouble profiletime(void);
 static void progresschange(WebKitWebView *v, gint p, Client *c);
+static void prompt(Client *c, const Arg *arg);
+static void promptactivate(GtkEntry *e, Client *c);
+static void promptchanged(GtkEditable *e, Client *c);
+static void promptgo(Client *c, gdouble start);
+static gboolean promptmatch(GtkEntryCompletion *ec, const char *key, GtkTreeIter *it, gpointer d);
+static gboolean promptselected(GtkEntryCompletion *ec, GtkTreeModel *m, GtkTreeIter *it, Client *c);
+static gboolean readcontrol(GIOChannel *ch, GIOCondition cond, gpointer d);
+static char *readcookies(int fd, off_t size);
+static gboolean readpressure(void);
+static gboolean refill(gpointer d);
 static void reload(Client *c, const Arg *arg);
-static void reloadcookies();
+static void reloadcookies(void);
+static gboolean remotewindow(const char *uri);
+static int replaycookies(char *data, GHashTable *live);
+static gboolean resumedownload(Download *d, const char *file);
+static void savedownload(Download *d);
+static gboolean savesession(gpointer d);
+static void requestqueued(SoupSession *s, SoupMessage *msg, gpointer d);
+static void requeststarted(SoupSession *s, SoupMessage *msg, SoupSocket *sock, gpointer d);
+static void requestunqueued(SoupSession *s, SoupMessage *msg, gpointer d);
 static void resize(GtkWidget *w, GtkAllocation *a, Client *c);
+static void resolved(SoupAddress *a, guint status, gpointer d);
+static void resourcestart(WebKitWebView *v, WebKitWebFrame *f, WebKitWebResource *r, WebKitNetworkRequest *req, WebKitNetworkResponse *res, Client *c);
+static void restoreclient(Client *c, gboolean load);
+static void restoresession(void);
 static void scroll(Client *c, const Arg *arg);
+static void segmentdone(SoupSession *session, SoupMessage *msg, gpointer d);
 static void setatom(Client *c, Atom a, const char *v);
+static void setcachemodel(void);
+static void sethidden(Client *c, gboolean hidden);
+static void setsite(Client *c, const char *settings);
 static void setup(void);
 static void sigchld(int unused);
+static const char *sitelookup(const char *key, gsize len);
+static const char *sitesettings(const char *uri);
+static void sigusr1(int unused);
 static void source(Client *c, const Arg *arg);
 static void spawn(Client *c, const Arg *arg);
+static gboolean speculate(gpointer d);
+static void speculated(SoupSession *s, SoupMessage *msg, gpointer d);
+static void startbench(const char *corpus);
+static void startdownloads(void);
+static gboolean startidle(gpointer d);
+static void startsegment(Segment *s);
 static void stop(Client *c, const Arg *arg);
+static void synccookies(void);
+static void throttle(SoupMessage *msg, SoupBuffer *chunk, gpointer d);
+static void throttletimers(Client *c, JSContextRef js);
+static void touchsession(void);
+static gboolean trickle(gpointer d);
 static void titlechange(WebKitWebView *v, WebKitWebFrame* frame, const char* title, Client *c);
 static void update(Client *c);
-static void updatedownload(WebKitDownload *o, GParamSpec *pspec, Client *c);
+static void updatedownload(WebKitDownload *o, GParamSpec *pspec, Download *d);
+static gboolean updatetitle(gpointer d);
 static void updatewinid(Client *c);
 static void usage(void);
+static gboolean visibility(GtkWidget *w, GdkEvent *e, Client *c);
+static void waitcookies(void);
+static gboolean warmexpired(gpointer k, gpointer v, gpointer now);
 static void windowobjectcleared(GtkWidget *w, WebKitWebFrame *frame, JSContextRef js, JSObjectRef win, Client *c);
+static gboolean writedownloads(gpointer d);
 static void zoom(Client *c, const Arg *arg);
 
 /* configuration, allows nested code to access above variables */
 #include "config.h"
 
-char *
-buildpath(const char *path) {
-	char *apath, *p;
-	FILE *f;
+gboolean
+acceptcontrol(GIOChannel *s, GIOCondition cond, gpointer d) {
+	int fd;
+	GIOChannel *ch;
 
-	/* creating directory */
-	if(path[0] == '/')
-		apath = g_strdup(path);
-	else
-		apath = g_strconcat(g_get_home_dir(), "/", path, NULL);
-	if((p = strrchr(apath, '/'))) {
-		*p = '\0';
-		g_mkdir_with_parents(apath, 0755);
-		*p = '/';
-	}
-	/* creating file (gives error when apath ends with "/") */
-	if((f = g_fopen(apath, "a")))
-		fclose(f);
-	return apath;
+	if((fd = accept(sock, NULL, NULL)) < 0)
+		return TRUE;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	ch = g_io_channel_unix_new(fd);
+	g_io_channel_set_close_on_unref(ch, TRUE);
+	g_io_channel_set_encoding(ch, NULL, NULL);
+	g_io_channel_set_flags(ch, G_IO_FLAG_NONBLOCK, NULL);
+	g_io_add_watch(ch, G_IO_IN|G_IO_HUP|G_IO_ERR, readcontrol, NULL);
+	g_io_channel_unref(ch);
+	return TRUE;
 }
 
 void
-changecookie(SoupCookieJar *j, SoupCookie *oc, SoupCookie *c, gpointer p) {
-	SoupDate *e;
-	SoupCookieJar *jar;
+appendcookie(const char *line) {
+	int fd;
+	size_t len;
+	struct stat st;
+	gboolean synced;
 
-	if(lockcookie)
+	if((fd = opencookies()) < 0)
 		return;
-	if(c && c->expires == NULL) {
-		e = soup_date_new_from_time_t(time(NULL) + sessiontime);
-		c = soup_cookie_copy(c);
-		soup_cookie_set_expires(c, e);
-	}
-	
-	jar = soup_cookie_jar_text_new(cookiefile, FALSE);
-	if(c)
-		soup_cookie_jar_add_cookie(jar, soup_cookie_copy(c));
-	else
-		soup_cookie_jar_delete_cookie(jar, oc);
-	g_object_unref(jar);
+	/* our own entries need not be read back if we were in sync */
+	synced = fstat(fd, &st) == 0 && st.st_ino == cookieino
+		&& st.st_size == cookieoff;
+	len = strlen(line);
+	counts[CountCookieWrites]++;
+	if(write(fd, line, len) != (ssize_t)len)
+		perror("surf: cannot write cookie");
+	else if(synced)
+		cookieoff += len;
+	close(fd);
+	cookiestale++;
 }
 
+/* loads the next corpus uri in c, the report follows the last load */
 void
-cleanup(void) {
-	while(clients)
-		destroyclient(clients);
-	g_free(cookiefile);
-	g_free(dldir);
-	g_free(scriptfile);
-	g_free(stylefile);
+benchload(Client *c) {
+	Arg arg;
+
+	if(benchnext < benchn) {
+		c->bench = benchnext++;
+		c->benchstart = g_timer_elapsed(benchtimer, NULL);
+		arg.v = benchuris[c->bench];
+		loaduri(c, &arg);
+	}
+	else if(benchdone == benchn) {
+		benchreport();
+		gtk_main_quit();
+	}
 }
 
+/* prints milliseconds per load phase as tab separated percentiles, failed
+ * loads only count up to the phase they reached */
 void
-clipboard(Client *c, const Arg *arg) {
-	gboolean paste = *(gboolean *)arg;
+benchreport(void) {
+	static const char *phases[] = { "started", "committed", "painted", "finished" };
+	int i, j, n;
 
-	if(paste)
-		gtk_clipboard_request_text(gtk_clipboard_get(GDK_SELECTION_PRIMARY), pasteuri, c);
-	else
-		gtk_clipboard_set_text(gtk_clipboard_get(GDK_SELECTION_PRIMARY), c->linkhover ? c->linkhover : geturi(c), -1);
+	printf("# jobs %d loads %d failed %d\n", benchjobs, benchn, benchfailed);
+	printf("phase\tn\tmin\tp50\tp90\tp99\tmax\n");
+	for(i = 0; i < LENGTH(phases); i++) {
+		for(j = n = 0; j < benchn; j++)
+			if(benchtimes[i][j] >= 0)
+				benchtimes[i][n++] = benchtimes[i][j] * 1000;
+		qsort(benchtimes[i], n, sizeof(gdouble), cmpdouble);
+		if(n)
+			printf("%s\t%d\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n", phases[i], n,
+					benchtimes[i][0], benchtimes[i][(n - 1) / 2],
+					benchtimes[i][(n - 1) * 9 / 10],
+					benchtimes[i][(n - 1) * 99 / 100], benchtimes[i][n - 1]);
+		else
+			printf("%s\t0\t-\t-\t-\t-\t-\n", phases[i]);
+	}
+	fflush(stdout);
 }
 
 void
-context(WebKitWebView *v, GtkMenu *m, Client *c) {
+benchstatus(WebKitWebView *v, GParamSpec *pspec, Client *c) {
 	int i;
-	GtkContainer *parent;
 
-	gtk_widget_hide_all(GTK_WIDGET(m));
-	gtk_widget_show(GTK_WIDGET(m));
-	for(i = 0; i < LENGTH(items); i++) {
-		parent = GTK_CONTAINER(gtk_widget_get_parent(c->items[i]));
-		if(parent)
-			gtk_container_remove(parent, c->items[i]);
-		gtk_menu_shell_append(GTK_MENU_SHELL(m), c->items[i]);
-		gtk_widget_show(c->items[i]);
+	if(c->bench < 0)
+		return;
+	switch(webkit_web_view_get_load_status(v)) {
+	case WEBKIT_LOAD_PROVISIONAL:
+		i = 0;
+		break;
+	case WEBKIT_LOAD_COMMITTED:
+		i = 1;
+		break;
+	case WEBKIT_LOAD_FIRST_VISUALLY_NON_EMPTY_LAYOUT:
+		i = 2;
+		break;
+	case WEBKIT_LOAD_FINISHED:
+		i = 3;
+		break;
+	case WEBKIT_LOAD_FAILED:
+		i = -1;
+		benchfailed++;
+		break;
+	default:
+		return;
+	}
+	if(i >= 0 && benchtimes[i][c->bench] < 0)
+		benchtimes[i][c->bench] = g_timer_elapsed(benchtimer, NULL) - c->benchstart;
+	if(i < 0 || i == 3) {
+		c->bench = -1;
+		benchdone++;
+		benchload(c);
 	}
 }
 
-char *
-copystr(char **str, const char *src) {
-	char *tmp;
-	tmp = g_strdup(src);
+/* matches every uri of corpus against the blocklist and prints the
+ * match rate and the time per uri */
+void
+blockbench(const char *corpus) {
+	int i, n, hits, rounds;
+	char *data, **l;
+	gdouble t;
+	GTimer *timer;
 
-	if(str && *str) {
-		g_free(*str);
-		*str = tmp;
+	if(!g_file_get_contents(corpus, &data, NULL, NULL))
+		die("surf: cannot read benchmark corpus\n");
+	l = g_strsplit(data, "\n", -1);
+	g_free(data);
+	for(i = n = 0; l[i]; i++)
+		if(*g_strstrip(l[i]) && l[i][0] != '#')
+			l[n++] = l[i];
+	if(!n)
+		die("surf: empty benchmark corpus\n");
+	rounds = MAX(1, 100000 / n);
+	timer = g_timer_new();
+	for(hits = 0, i = 0; i < n * rounds; i++)
+		hits += blocked(l[i % n]);
+	t = g_timer_elapsed(timer, NULL);
+	printf("rules\t%u hosts\t%u states\n",
+			blockindex ? blockindex->nhosts : 0,
+			blockindex ? blockindex->nstates : 0);
+	printf("uris\t%d\nblocked\t%d\t%.1f%%\nns/uri\t%.0f\n", n, hits / rounds,
+			100.0 * hits / rounds / n, t * 1e9 / n / rounds);
+	g_timer_destroy(timer);
+	g_strfreev(l);
+}
+
+gboolean
+blocked(const char *uri) {
+	const char *h, *e, *p;
+	guint32 s, t;
+
+	if(!blockindex)
+		return FALSE;
+	if((h = strstr(uri, "://"))) {
+		h += 3;
+		for(e = h; *e && *e != '/' && *e != ':' && *e != '?'; e++);
+		for(p = h; p; p = memchr(p, '.', e - p), p = p ? p + 1 : NULL)
+			if(blockhost(p, e - p))
+				return TRUE;
 	}
-	return tmp;
+	for(s = 0, p = uri; *p; p++) {
+		while(!(t = blockgo(blockstates, blocktrans, s, g_ascii_tolower(*p))) && s)
+			s = blockstates[s].fail;
+		if((s = t) && blockstates[s].match)
+			return TRUE;
+	}
+	return FALSE;
 }
 
-WebKitWebView *
-createwindow(WebKitWebView  *v, WebKitWebFrame *f, Client *c) {
-	Client *n = newclient();
-	return n->view;
+guint32
+blockgo(BlockState *st, BlockTrans *tr, guint32 s, guchar c) {
+	guint32 lo = st[s].first, hi = st[s].first + st[s].n, m;
+
+	while(lo < hi) {
+		m = (lo + hi) / 2;
+		if(tr[m].c < c)
+			lo = m + 1;
+		else if(tr[m].c > c)
+			hi = m;
+		else
+			return tr[m].next;
+	}
+	return 0;
+}
+
+/* FNV-1a of the lower case string */
+guint32
+blockhash(const char *s, gsize len) {
+	guint32 h = 2166136261U;
+
+	while(len--)
+		h = (h ^ (guchar)g_ascii_tolower(*s++)) * 16777619U;
+	return h;
 }
 
 gboolean
-decidedownload(WebKitWebView *v, WebKitWebFrame *f, WebKitNetworkRequest *r, gchar *m,  WebKitWebPolicyDecision *p, Client *c) {
-	if(!webkit_web_view_can_show_mime_type(v, m)) {
-		webkit_web_policy_decision_download(p);
-		return TRUE;
+blockhost(const char *host, gsize len) {
+	guint32 i, mask = blockindex->hashsize - 1;
+	const char *h;
+
+	for(i = blockhash(host, len) & mask; blockhosts[i]; i = (i + 1) & mask) {
+		h = blockpool + blockhosts[i] - 1;
+		if(!g_ascii_strncasecmp(h, host, len) && !h[len])
+			return TRUE;
 	}
 	return FALSE;
 }
 
-gboolean
-decidewindow(WebKitWebView *view, WebKitWebFrame *f, WebKitNetworkRequest *r, WebKitWebNavigationAction *n, WebKitWebPolicyDecision *p, Client *c) {
-	Arg arg;
+/* reduces a line of the blocklist to a host or pattern, NULL if it holds
+ * none. Understands hosts files, "0.0.0.0 host # comment", and adblock
+ * "||host^$options" lines; exceptions and element rules are skipped. */
+char *
+blockrule(char *l) {
+	char *p;
 
-	if(webkit_web_navigation_action_get_reason(n) == WEBKIT_WEB_NAVIGATION_REASON_LINK_CLICKED) {
-		webkit_web_policy_decision_ignore(p);
-		arg.v = (void *)webkit_network_request_get_uri(r);
-		newwindow(NULL, &arg);
-		return TRUE;
+	l = g_strstrip(l);
+	if(!*l || *l == '#' || *l == '!' || *l == '[' || g_str_has_prefix(l, "@@")
+			|| strstr(l, "##") || strstr(l, "#@#"))
+		return NULL;
+	p = l + strcspn(l, " \t");
+	if(*p && strspn(l, "0123456789abcdefABCDEF.:") == p - l) {
+		l = p + strspn(p, " \t");
+		l[strcspn(l, " \t#")] = '\0';
+		/* localhost and friends */
+		if(!strchr(l, '.'))
+			return NULL;
 	}
-	return FALSE;
+	else if(g_str_has_prefix(l, "||")) {
+		l += 2;
+		if((p = strchr(l, '$')))
+			*p = '\0';
+		if(*l && l[strlen(l) - 1] == '^')
+			l[strlen(l) - 1] = '\0';
+	}
+	return *l ? l : NULL;
 }
 
-void
-destroyclient(Client *c) {
-	int i;
-	Client *p;
+/* compiles the rules of src into the index dst. Lines are host names,
+ * matching subdomains too, or contain a / and match anywhere in a uri. */
+gboolean
+buildblocklist(const char *src, const char *dst) {
+	int fd;
+	guint i, j, n, nhosts = 0, hashsize, nstates = 1, *keys;
+	guint32 s, t, f, g, *hash, *queue;
+	char *data, **lines, **rules, *l, *tmp;
+	gpointer v;
+	GString *pool;
+	GHashTable *trie;
+	GHashTableIter it;
+	GArray *match;
+	BlockState *st;
+	BlockTrans *tr;
+	BlockHeader hdr = { "surfbl2" };
+	gboolean ok;
 
-	gtk_widget_destroy(c->indicator);
-	gtk_widget_destroy(GTK_WIDGET(c->view));
-	gtk_widget_destroy(c->scroll);
-	gtk_widget_destroy(c->vbox);
-	gtk_widget_destroy(c->win);
-	for(i = 0; i < LENGTH(items); i++)
-		gtk_widget_destroy(c->items[i]);
-	free(c->items);
+	if(!g_file_get_contents(src, &data, NULL, NULL))
+		return FALSE;
+	lines = g_strsplit(data, "\n", -1);
+	g_free(data);
+	rules = g_new(char *, g_strv_length(lines));
+	for(n = 0; lines[n]; n++)
+		if((rules[n] = blockrule(lines[n])) && !strchr(rules[n], '/'))
+			nhosts++;
+	for(hashsize = 1; hashsize < nhosts * 2; hashsize <<= 1);
+	hash = g_new0(guint32, hashsize);
+	pool = g_string_new(NULL);
+	trie = g_hash_table_new(g_direct_hash, g_direct_equal);
+	match = g_array_new(FALSE, TRUE, sizeof(guint32));
+	g_array_set_size(match, 1);
+	for(i = 0; i < n; i++) {
+		if(!(l = rules[i]))
+			continue;
+		if(!strchr(l, '/')) {
+			for(j = blockhash(l, strlen(l)) & (hashsize - 1); hash[j];
+					j = (j + 1) & (hashsize - 1));
+			hash[j] = pool->len + 1;
+			g_string_append_len(pool, l, strlen(l) + 1);
+			continue;
+		}
+		/* a pattern cut short at the state limit would match too much */
+		if(nstates + strlen(l) >= 1 << 24)
+			continue;
+		for(s = 0; *l; l++) {
+			if((v = g_hash_table_lookup(trie,
+					GUINT_TO_POINTER(s << 8 | (guchar)g_ascii_tolower(*l)))))
+				s = GPOINTER_TO_UINT(v);
+			else {
+				g_hash_table_insert(trie, GUINT_TO_POINTER(s << 8 | (guchar)g_ascii_tolower(*l)),
+						GUINT_TO_POINTER(nstates));
+				g_array_set_size(match, nstates + 1);
+				s = nstates++;
+			}
+		}
+		g_array_index(match, guint32, s) = 1;
+	}
+	g_free(rules);
+	g_strfreev(lines);
 
-	for(p = clients; p && p->next != c; p = p->next);
-	if(p)
-		p->next = c->next;
-	else
-		clients = c->next;
-	free(c);
-	if(clients == NULL)
-		gtk_main_quit();
-}
+	/* transitions sorted by state and character */
+	hdr.ntrans = g_hash_table_size(trie);
+	keys = g_new(guint, hdr.ntrans);
+	g_hash_table_iter_init(&it, trie);
+	for(i = 0; g_hash_table_iter_next(&it, &v, NULL); i++)
+		keys[i] = GPOINTER_TO_UINT(v);
+	qsort(keys, hdr.ntrans, sizeof(guint), cmpkey);
+	st = g_new0(BlockState, nstates);
+	tr = g_new(BlockTrans, hdr.ntrans);
+	for(i = 0; i < hdr.ntrans; i++) {
+		s = keys[i] >> 8;
+		if(!st[s].n++)
+			st[s].first = i;
+		tr[i].c = keys[i] & 0xff;
+		tr[i].next = GPOINTER_TO_UINT(g_hash_table_lookup(trie, GUINT_TO_POINTER(keys[i])));
+	}
+	/* failure links breadth first, matches are inherited along them */
+	queue = g_new(guint32, nstates);
+	queue[0] = 0;
+	for(i = 0, n = 1; i < n; i++) {
+		s = queue[i];
+		for(j = st[s].first; j < st[s].first + st[s].n; j++) {
+			t = tr[j].next;
+			for(f = st[s].fail; f && !blockgo(st, tr, f, tr[j].c); f = st[f].fail);
+			g = blockgo(st, tr, f, tr[j].c);
+			st[t].fail = g != t ? g : 0;
+			st[t].match = g_array_index(match, guint32, t)
+				| g_array_index(match, guint32, st[t].fail);
+			g_array_index(match, guint32, t) = st[t].match;
+			queue[n++] = t;
+		}
+	}
+	hdr.nhosts = nhosts;
+	hdr.hashsize = hashsize;
+	hdr.nstates = nstates;
+	hdr.poolsize = pool->len;
 
-void
-destroywin(GtkWidget* w, Client *c) {
-	destroyclient(c);
+	tmp = g_strdup_printf("%s.%d", dst, (int)getpid());
+	ok = (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0
+		&& write(fd, &hdr, sizeof hdr) == sizeof hdr
+		&& write(fd, hash, hashsize * sizeof *hash) == hashsize * sizeof *hash
+		&& write(fd, st, nstates * sizeof *st) == nstates * sizeof *st
+		&& write(fd, tr, hdr.ntrans * sizeof *tr) == hdr.ntrans * sizeof *tr
+		&& write(fd, pool->str, pool->len) == pool->len;
+	if(fd >= 0 && close(fd) < 0)
+		ok = FALSE;
+	if(!ok || rename(tmp, dst) < 0) {
+		perror("surf: cannot write blocklist index");
+		unlink(tmp);
+		ok = FALSE;
+	}
+	g_free(tmp);
+	g_free(queue);
+	g_free(tr);
+	g_free(st);
+	g_free(keys);
+	g_array_free(match, TRUE);
+	g_hash_table_destroy(trie);
+	g_string_free(pool, TRUE);
+	g_free(hash);
+	return ok;
 }
 
-void
-die(char *str) {
-	fputs(str, stderr);
-	exit(EXIT_FAILURE);
+/* aggregates the history log src into the index dst and rewrites it with
+ * a visit and a title line per uri. The exclusive lock keeps histrecord()
+ * of all processes out meanwhile. */
+gboolean
+buildhistory(const char *src, const char *dst) {
+	int fd, lfd;
+	guint i, n;
+	guint32 *ranks;
+	char *data, *p, *e, *tmp, *ltmp;
+	time_t now = time(NULL);
+	gpointer v;
+	GString *pool, *log;
+	GHashTable *items;
+	GHashTableIter it;
+	HistItem *all;
+	HistEntry *entries;
+	HistHeader hdr = { "surfhi2" };
+	struct stat st;
+	gboolean ok;
+
+	if((lfd = histopen(src, LOCK_EX)) < 0)
+		return FALSE;
+	if(fstat(lfd, &st) < 0) {
+		close(lfd);
+		return FALSE;
+	}
+	data = g_malloc(st.st_size + 1);
+	if(pread(lfd, data, st.st_size, 0) != st.st_size) {
+		g_free(data);
+		close(lfd);
+		return FALSE;
+	}
+	data[st.st_size] = '\0';
+	items = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+	for(p = data; (e = strchr(p, '\n')); p = e + 1) {
+		*e = '\0';
+		histadd(items, p);
+	}
+	n = hdr.n = g_hash_table_size(items);
+	all = g_new(HistItem, n);
+	g_hash_table_iter_init(&it, items);
+	for(i = 0; g_hash_table_iter_next(&it, NULL, &v); i++)
+		all[i] = *(HistItem *)v;
+	qsort(all, n, sizeof *all, cmphistkey);
+	entries = g_new(HistEntry, n);
+	pool = g_string_new(NULL);
+	log = g_string_new(NULL);
+	for(i = 0; i < n; i++) {
+		if(all[i].visits)
+			g_string_append_printf(log, "v\t%ld\t%s\t%u\n", (long)all[i].last,
+					all[i].uri, all[i].visits);
+		if(all[i].title)
+			g_string_append_printf(log, "t\t%s\t%s\n", all[i].uri, all[i].title);
+		all[i].pos = i;
+		all[i].score = histscore(all[i].visits, all[i].last, now);
+		entries[i].uri = pool->len;
+		entries[i].key = pool->len + (histkey(all[i].uri) - all[i].uri);
+		entries[i].visits = all[i].visits;
+		entries[i].last = all[i].last;
+		g_string_append_len(pool, all[i].uri, strlen(all[i].uri) + 1);
+		entries[i].title = pool->len;
+		p = all[i].title ? all[i].title : "";
+		g_string_append_len(pool, p, strlen(p) + 1);
+	}
+	qsort(all, n, sizeof *all, cmphistscore);
+	ranks = g_new(guint32, n);
+	for(i = 0; i < n; i++)
+		ranks[i] = all[i].pos;
+	hdr.poolsize = pool->len;
+	hdr.logsize = log->len;
+
+	/* the index goes first, a log left uncompacted only looks like a
+	 * longer tail */
+	tmp = g_strdup_printf("%s.%d", dst, (int)getpid());
+	ltmp = g_strdup_printf("%s.%d", src, (int)getpid());
+	ok = (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0
+		&& write(fd, &hdr, sizeof hdr) == sizeof hdr
+		&& write(fd, entries, n * sizeof *entries) == n * sizeof *entries
+		&& write(fd, ranks, n * sizeof *ranks) == n * sizeof *ranks
+		&& write(fd, pool->str, pool->len) == pool->len;
+	if(fd >= 0 && close(fd) < 0)
+		ok = FALSE;
+	if(ok && (!g_file_set_contents(ltmp, log->str, log->len, NULL)
+				|| chmod(ltmp, 0600) < 0))
+		ok = FALSE;
+	if(!ok || rename(tmp, dst) < 0 || rename(ltmp, src) < 0) {
+		perror("surf: cannot write history index");
+		unlink(tmp);
+		unlink(ltmp);
+		ok = FALSE;
+	}
+	close(lfd);
+	g_free(tmp);
+	g_free(ltmp);
+	g_string_free(log, TRUE);
+	g_string_free(pool, TRUE);
+	g_free(ranks);
+	g_free(entries);
+	g_free(all);
+	g_hash_table_destroy(items);
+	g_free(data);
+	return ok;
 }
 
-void
-download(Client *c, const Arg *arg) {
-	char *uri;
-	WebKitNetworkRequest *r;
-	WebKitDownload       *dl;
+char *
+buildpath(const char *path) {
+	char *apath;
 
-	if(arg->v)
-		uri = (char *)arg->v;
-	else
-		uri = c->linkhover ? c->linkhover : geturi(c);
-	r = webkit_network_request_new(uri);
-	dl = webkit_download_new(r);
-	initdownload(c->view, dl, c);
+	apath = expandpath(path);
+	createpath(apath);
+	return apath;
 }
 
-void
-drawindicator(Client *c) {
-	gint width;
-	const char *uri;
-	GtkWidget *w;
-	GdkGC *gc;
-	GdkColor fg;
+/* compiles the site rules of src, a host pattern and its settings per
+ * line, into the index dst */
+gboolean
+buildsites(const char *src, const char *dst) {
+	int fd;
+	guint i, j, n, nsites = 0, hashsize;
+	guint32 *hash;
+	char *data, **lines, *l, *e, *tmp;
+	GString *pool;
+	SiteHeader hdr = { "surfst1" };
+	gboolean ok;
 
-	uri = getatom(c, uriprop);
-	w = c->indicator;
-	width = c->progress * w->allocation.width / 100;
-	gc = gdk_gc_new(w->window);
-	gdk_color_parse(strstr(uri, "https://") == uri ?
-			progress_trust : progress, &fg);
-	gdk_gc_set_rgb_fg_color(gc, &fg);
-	gdk_draw_rectangle(w->window,
-			w->style->bg_gc[GTK_WIDGET_STATE(w)],
-			TRUE, 0, 0, w->allocation.width, w->allocation.height);
-	gdk_draw_rectangle(w->window, gc, TRUE, 0, 0, width,
-			w->allocation.height);
-	g_object_unref(gc);
+	if(!g_file_get_contents(src, &data, NULL, NULL))
+		return FALSE;
+	lines = g_strsplit(data, "\n", -1);
+	g_free(data);
+	for(n = 0; lines[n]; n++)
+		if(*g_strstrip(lines[n]) && lines[n][0] != '#')
+			nsites++;
+	for(hashsize = 1; hashsize < nsites * 2; hashsize <<= 1);
+	hash = g_new0(guint32, hashsize);
+	pool = g_string_new(NULL);
+	for(i = 0; i < n; i++) {
+		l = lines[i];
+		if(!*l || *l == '#')
+			continue;
+		for(e = l; *e && !g_ascii_isspace(*e); e++);
+		if(*l == '*')
+			l++;
+		if(e == l)
+			l = ".", e = l + 1;
+		for(j = blockhash(l, e - l) & (hashsize - 1); hash[j];
+				j = (j + 1) & (hashsize - 1));
+		hash[j] = pool->len + 1;
+		g_string_append_len(pool, l, e - l);
+		g_string_append_c(pool, '\0');
+		while(g_ascii_isspace(*e))
+			e++;
+		g_string_append_len(pool, e, strlen(e) + 1);
+	}
+	g_strfreev(lines);
+	hdr.nsites = nsites;
+	hdr.hashsize = hashsize;
+	hdr.poolsize = pool->len;
+
+	tmp = g_strdup_printf("%s.%d", dst, (int)getpid());
+	ok = (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0
+		&& write(fd, &hdr, sizeof hdr) == sizeof hdr
+		&& write(fd, hash, hashsize * sizeof *hash) == hashsize * sizeof *hash
+		&& write(fd, pool->str, pool->len) == pool->len;
+	if(fd >= 0 && close(fd) < 0)
+		ok = FALSE;
+	if(!ok || rename(tmp, dst) < 0) {
+		perror("surf: cannot write site index");
+		unlink(tmp);
+		ok = FALSE;
+	}
+	g_free(tmp);
+	g_free(hash);
+	g_string_free(pool, TRUE);
+	return ok;
 }
 
+/* a click starts whatever comes next, not the prompt's navigation */
 gboolean
-exposeindicator(GtkWidget *w, GdkEventExpose *e, Client *c) {
-	drawindicator(c);
-	return TRUE;
+buttonpress(GtkWidget *w, GdkEventButton *ev, Client *c) {
+	c->prompted = 0;
+	return FALSE;
 }
 
 void
-find(Client *c, const Arg *arg) {
-	const char *s;
+cachechunk(SoupMessage *msg, SoupBuffer *chunk, gpointer d) {
+	GByteArray *body;
 
-	s = getatom(c, findprop);
-	gboolean forward = *(gboolean *)arg;
-	webkit_web_view_search_text(c->view, s, FALSE, forward, TRUE);
+	if(!(body = g_object_get_data(G_OBJECT(msg), "cache")))
+		return;
+	if(body->len + chunk->length > cacheobject)
+		g_object_set_data(G_OBJECT(msg), "cache", NULL);
+	else
+		g_byte_array_append(body, (guint8 *)chunk->data, chunk->length);
 }
 
-const char *
-getatom(Client *c, Atom a) {
-	static char buf[BUFSIZ];
-	Atom adummy;
-	int idummy;
-	unsigned long ldummy;
-	unsigned char *p = NULL;
+void
+cachefree(gpointer d) {
+	CacheItem *it = d;
 
-	XGetWindowProperty(dpy, GDK_WINDOW_XID(GTK_WIDGET(c->win)->window),
-			a, 0L, BUFSIZ, False, XA_STRING,
-			&adummy, &idummy, &ldummy, &ldummy, &p);
-	if(p)
-		strncpy(buf, (char *)p, LENGTH(buf)-1);
-	else
-		buf[0] = '\0';
-	XFree(p);
-	return buf;
+	g_free(it->uri);
+	g_free(it->head);
+	if(it->body)
+		g_byte_array_unref(it->body);
+	g_free(it);
 }
 
-char *
-geturi(Client *c) {
-	char *uri;
+/* returns until when a response is fresh by its Cache-Control, Expires or
+ * Last-Modified headers, 0 if it must not be stored. A 304 passed the
+ * other checks when its entry was stored. */
+time_t
+cachefresh(SoupMessage *msg) {
+	int i;
+	time_t now, t = 0, date;
+	const char *cc, *v;
+	SoupMessageHeaders *h = msg->response_headers;
+	SoupDate *d;
 
-	if(!(uri = (char *)webkit_web_view_get_uri(c->view)))
-		uri = "about:blank";
-	return uri;
-}
+	if(soup_message_headers_get(h, "Set-Cookie"))
+		return 0;
+	if(msg->status_code != SOUP_STATUS_NOT_MODIFIED) {
+		if(msg->status_code != SOUP_STATUS_OK
+				|| ((v = soup_message_headers_get(h, "Vary"))
+					&& strcmp(v, "Accept-Encoding"))
+				|| ((v = soup_message_headers_get(h, "Content-Encoding"))
+					&& strcmp(v, "identity"))
+				|| !(v = soup_message_headers_get_content_type(h, NULL)))
+			return 0;
+		for(i = 0; i < LENGTH(cachetypes) && !g_str_has_prefix(v, cachetypes[i]); i++);
+		if(i == LENGTH(cachetypes))
+			return 0;
+	}
 
-gboolean
-initdownload(WebKitWebView *view, WebKitDownload *o, Client *c) {
-	const char *filename;
-	char *uri, *html;
-
-	stop(c, NULL);
-	c->download = o;
-	filename = webkit_download_get_suggested_filename(o);
-	if(!strcmp("", filename))
-		filename = "index.html";
-	uri = g_strconcat("file://", dldir, "/", filename, NULL);
-	webkit_download_set_destination_uri(c->download, uri);
-	c->progress = 0;
-	g_free(uri);
-	html = g_strdup_printf("Download <b>%s</b>...", filename);
-	webkit_web_view_load_html_string(c->view, html,
-			webkit_download_get_uri(c->download));
-	g_signal_connect(c->download, "notify::progress", G_CALLBACK(updatedownload), c);
-	g_signal_connect(c->download, "notify::status", G_CALLBACK(updatedownload), c);
-	webkit_download_start(c->download);
-	
-	c->title = copystr(&c->title, filename);
-	update(c);
-	g_free(html);
-	return TRUE;
+	now = time(NULL);
+	date = now;
+	if((v = soup_message_headers_get(h, "Date"))
+			&& (d = soup_date_new_from_string(v))) {
+		date = soup_date_to_time_t(d);
+		soup_date_free(d);
+	}
+	cc = soup_message_headers_get(h, "Cache-Control");
+	if(cc && (strstr(cc, "no-store") || strstr(cc, "no-cache")
+				|| strstr(cc, "private")))
+		t = 0;
+	else if(cc && (v = strstr(cc, "max-age="))) {
+		t = now + strtol(v + 8, NULL, 10);
+		if((v = soup_message_headers_get(h, "Age")))
+			t -= strtol(v, NULL, 10);
+	}
+	else if((v = soup_message_headers_get(h, "Expires"))
+			&& (d = soup_date_new_from_string(v))) {
+		t = now + soup_date_to_time_t(d) - date;
+		soup_date_free(d);
+	}
+	else if((v = soup_message_headers_get(h, "Last-Modified"))
+			&& (d = soup_date_new_from_string(v))) {
+		t = now + MIN((date - soup_date_to_time_t(d)) / 10, 86400);
+		soup_date_free(d);
+	}
+	return t > now ? t : 0;
 }
 
+/* keeps a copy of responses which may be stored while they arrive, a 304
+ * to a conditional request of WebKit revalidates the stored entry */
 void
-itemclick(GtkMenuItem *mi, Client *c) {
-	int i;
-	const char *label;
+cacheheaders(SoupMessage *msg, gpointer d) {
+	goffset len;
+	time_t expires;
+	char *uri;
+	CacheItem *it;
 
-	label = gtk_menu_item_get_label(mi);
-	for(i = 0; i < LENGTH(items); i++)
-		if(!strcmp(items[i].label, label))
-			items[i].func(c, &(items[i].arg));
+	if(!(expires = cachefresh(msg)))
+		return;
+	if(msg->status_code == SOUP_STATUS_NOT_MODIFIED) {
+		uri = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+		if((it = g_hash_table_lookup(cachemem, uri)))
+			it->expires = expires;
+		cachequeue(CacheRefresh, uri, expires);
+		g_free(uri);
+		return;
+	}
+	len = soup_message_headers_get_content_length(msg->response_headers);
+	if(len > cacheobject)
+		return;
+	g_object_set_data_full(G_OBJECT(msg), "cache", g_byte_array_sized_new(len),
+			(GDestroyNotify)g_byte_array_unref);
+	g_signal_connect(msg, "got-chunk", G_CALLBACK(cachechunk), NULL);
+}
+
+/* keeps an entry in memory where requestqueued() answers from, stored
+ * responses replace older ones, preloaded ones do not */
+gboolean
+cachekeep(gpointer d) {
+	time_t now;
+	CacheItem *it = d, *o;
+
+	if((o = g_hash_table_lookup(cachemem, it->uri))) {
+		if(it->job == CachePreload) {
+			cachefree(it);
+			return FALSE;
+		}
+		cachememused -= o->body->len;
+		g_hash_table_remove(cachemem, it->uri);
+	}
+	if(cachememused + it->body->len > cachememory) {
+		now = time(NULL);
+		g_hash_table_foreach_remove(cachemem, cachestale, &now);
+	}
+	if(cachememused + it->body->len > cachememory) {
+		cachefree(it);
+		return FALSE;
+	}
+	cachememused += it->body->len;
+	g_hash_table_insert(cachemem, it->uri, it);
+	return FALSE;
+}
+
+void
+cacheline(const char *name, const char *value, gpointer d) {
+	if(g_ascii_strcasecmp(name, "Connection")
+			&& g_ascii_strcasecmp(name, "Keep-Alive")
+			&& g_ascii_strcasecmp(name, "Transfer-Encoding"))
+		g_string_append_printf((GString *)d, "%s: %s\n", name, value);
+}
+
+char *
+cachepath(const char *uri) {
+	char *sum, *path;
+
+	sum = g_compute_checksum_for_string(G_CHECKSUM_MD5, uri, -1);
+	path = g_strconcat(cachedir, sum, NULL);
+	g_free(sum);
+	return path;
+}
+
+/* reads the most recently used entries of all processes into memory,
+ * up to cachememory bytes */
+void
+cachepreload(void) {
+	int i;
+	long total = 0;
+	const char *name;
+	CacheEntry e;
+	CacheItem *it;
+	GArray *a;
+	GDir *dir;
+	struct stat st;
+
+	if(!(dir = g_dir_open(cachedir, 0, NULL)))
+		return;
+	a = g_array_new(FALSE, FALSE, sizeof(CacheEntry));
+	while((name = g_dir_read_name(dir))) {
+		e.path = g_strconcat(cachedir, name, NULL);
+		if(stat(e.path, &st) < 0 || st.st_size > cacheobject + 4096) {
+			g_free(e.path);
+			continue;
+		}
+		e.mtime = st.st_mtime;
+		e.size = st.st_size;
+		g_array_append_val(a, e);
+	}
+	g_dir_close(dir);
+	qsort(a->data, a->len, sizeof(CacheEntry), cmpentry);
+	for(i = a->len - 1; i >= 0; i--) {
+		e = g_array_index(a, CacheEntry, i);
+		if(total + e.size <= cachememory) {
+			it = g_new0(CacheItem, 1);
+			it->job = CachePreload;
+			if(cacheread(e.path, it) && it->expires > time(NULL)) {
+				total += it->body->len;
+				g_idle_add(cachekeep, it);
+			}
+			else
+				cachefree(it);
+		}
+		g_free(e.path);
+	}
+	g_array_free(a, TRUE);
+}
+
+/* deletes the least recently used entries of all processes until the
+ * cache is below 90% of cachesize */
+void
+cacheprune(void) {
+	guint i;
+	off_t total = 0;
+	const char *name;
+	CacheEntry e;
+	GArray *a;
+	GDir *dir;
+	struct stat st;
+
+	if(!(dir = g_dir_open(cachedir, 0, NULL)))
+		return;
+	a = g_array_new(FALSE, FALSE, sizeof(CacheEntry));
+	while((name = g_dir_read_name(dir))) {
+		e.path = g_strconcat(cachedir, name, NULL);
+		if(stat(e.path, &st) < 0) {
+			g_free(e.path);
+			continue;
+		}
+		e.mtime = st.st_mtime;
+		e.size = st.st_size;
+		total += e.size;
+		g_array_append_val(a, e);
+	}
+	g_dir_close(dir);
+	qsort(a->data, a->len, sizeof(CacheEntry), cmpentry);
+	for(i = 0; i < a->len; i++) {
+		e = g_array_index(a, CacheEntry, i);
+		if(total > cachesize / 10 * 9 && unlink(e.path) == 0)
+			total -= e.size;
+		g_free(e.path);
+	}
+	g_array_free(a, TRUE);
+}
+
+/* hands a file job to the cache thread */
+void
+cachequeue(int job, const char *uri, time_t expires) {
+	CacheItem *it;
+
+	it = g_new0(CacheItem, 1);
+	it->job = job;
+	it->uri = g_strdup(uri);
+	it->expires = expires;
+	g_thread_pool_push(cachepool, it, NULL);
+}
+
+/* parses an "expires uri" line, the response headers, an empty line and
+ * the body */
+gboolean
+cacheread(const char *path, CacheItem *it) {
+	char *data, *p, *e, *b;
+	gsize len;
+
+	if(!g_file_get_contents(path, &data, &len, NULL))
+		return FALSE;
+	it->expires = strtoul(data, &p, 10);
+	if(*p != ' ' || !g_str_has_prefix(p + 1, "http")
+			|| !(e = strchr(p, '\n')) || !(b = strstr(e, "\n\n"))) {
+		g_free(data);
+		return FALSE;
+	}
+	g_free(it->uri);
+	g_free(it->head);
+	if(it->body)
+		g_byte_array_unref(it->body);
+	it->uri = g_strndup(p + 1, e - p - 1);
+	it->head = g_strndup(e + 1, b - e);
+	b += 2;
+	it->body = g_byte_array_sized_new(len - (b - data));
+	g_byte_array_append(it->body, (guint8 *)b, len - (b - data));
+	g_free(data);
+	return TRUE;
+}
+
+/* answers a message from memory before the session sends it. The uri
+ * stays the same, so the page sees the response under its own origin. */
+gboolean
+cacheserve(gpointer d) {
+	char *uri, *p, *e, *v, *name;
+	SoupMessage *msg = d;
+	CacheItem *it;
+
+	uri = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+	if(g_object_get_data(G_OBJECT(msg), "cachehit")
+			&& (it = g_hash_table_lookup(cachemem, uri))) {
+		for(p = it->head; (e = strchr(p, '\n')); p = e + 1) {
+			if(!(v = memchr(p, ':', e - p)))
+				continue;
+			name = g_strndup(p, v - p);
+			v = g_strstrip(g_strndup(v + 1, e - v - 1));
+			soup_message_headers_append(msg->response_headers, name, v);
+			g_free(name);
+			g_free(v);
+		}
+		soup_message_body_append(msg->response_body, SOUP_MEMORY_COPY,
+				it->body->data, it->body->len);
+		/* WebKit takes the body from msg->response_body->data */
+		soup_buffer_free(soup_message_body_flatten(msg->response_body));
+		cachequeue(CacheTouch, uri, 0);
+		soup_session_cancel_message(session, msg, SOUP_STATUS_OK);
+	}
+	g_free(uri);
+	g_object_unref(msg);
+	return FALSE;
+}
+
+gboolean
+cachestale(gpointer k, gpointer v, gpointer now) {
+	CacheItem *it = v;
+
+	if(it->expires > *(time_t *)now)
+		return FALSE;
+	cachememused -= it->body->len;
+	return TRUE;
+}
+
+/* keeps the response in memory and lets the cache thread write it */
+void
+cachestore(SoupMessage *msg, GByteArray *body) {
+	time_t expires;
+	goffset len;
+	GString *head;
+	CacheItem *it, *m;
+
+	len = soup_message_headers_get_content_length(msg->response_headers);
+	if((len && len != body->len) || !(expires = cachefresh(msg)))
+		return;
+	head = g_string_new(NULL);
+	soup_message_headers_foreach(msg->response_headers, cacheline, head);
+	it = g_new0(CacheItem, 1);
+	it->job = CacheStore;
+	it->uri = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+	it->expires = expires;
+	it->head = g_string_free(head, FALSE);
+	it->body = g_byte_array_ref(body);
+	m = g_new0(CacheItem, 1);
+	m->job = CacheStore;
+	m->uri = g_strdup(it->uri);
+	m->expires = expires;
+	m->head = g_strdup(it->head);
+	m->body = g_byte_array_ref(body);
+	cachekeep(m);
+	g_thread_pool_push(cachepool, it, NULL);
+	counts[CountCacheStores]++;
+	cachewritten += body->len;
+	if(cachewritten > cachesize / 16) {
+		cachewritten = 0;
+		cachequeue(CachePrune, NULL, 0);
+	}
+}
+
+/* runs in the cache thread, it only touches files */
+void
+cachework(gpointer data, gpointer d) {
+	time_t expires;
+	char *path = NULL;
+	CacheItem *it = data;
+
+	if(it->uri)
+		path = cachepath(it->uri);
+	switch(it->job) {
+	case CachePreload:
+		cachepreload();
+		break;
+	case CachePrune:
+		cacheprune();
+		break;
+	case CacheRefresh:
+		expires = it->expires;
+		if(cacheread(path, it)) {
+			it->expires = expires;
+			cachewrite(path, it);
+		}
+		break;
+	case CacheStore:
+		cachewrite(path, it);
+		break;
+	case CacheTouch:
+		utime(path, NULL);
+		break;
+	}
+	g_free(path);
+	cachefree(it);
+}
+
+/* entries are written to a private file and renamed into place, so
+ * concurrent processes only ever see complete ones */
+void
+cachewrite(const char *path, CacheItem *it) {
+	int err;
+	char *tmp;
+	FILE *f;
+
+	tmp = g_strdup_printf("%s.%d", path, (int)getpid());
+	if((f = fopen(tmp, "w"))) {
+		fprintf(f, "%lu %s\n%s\n", (unsigned long)it->expires, it->uri, it->head);
+		fwrite(it->body->data, 1, it->body->len, f);
+		err = ferror(f);
+		if(fclose(f) || err || rename(tmp, path) < 0)
+			unlink(tmp);
+	}
+	g_free(tmp);
+}
+
+void
+canceldownload(Download *d) {
+	if(d->dl)
+		webkit_download_cancel(d->dl);
+	else
+		faildownload(d);
+}
+
+void
+changecookie(SoupCookieJar *j, SoupCookie *oc, SoupCookie *c, gpointer p) {
+	char *line;
+	SoupCookie *old = NULL;
+
+	/* the stored cookies replace the jar, this change goes on top */
+	if(cookiereader) {
+		c = c ? soup_cookie_copy(c) : NULL;
+		oc = old = oc ? soup_cookie_copy(oc) : NULL;
+		waitcookies();
+		lockcookie = TRUE;
+		if(c)
+			soup_cookie_jar_add_cookie(cookies, c);
+		else if(oc)
+			soup_cookie_jar_delete_cookie(cookies, oc);
+		lockcookie = FALSE;
+	}
+	if(lockcookie)
+		return;
+	probebegin(ProbeCookie);
+	/* session cookies are kept for sessiontime seconds, deleted
+	 * cookies are journaled as already expired entries */
+	if(c)
+		line = cookieline(c, c->expires ? soup_date_to_time_t(c->expires)
+				: time(NULL) + sessiontime);
+	else
+		line = cookieline(oc, 0);
+	appendcookie(line);
+	g_free(line);
+	if(old)
+		soup_cookie_free(old);
+	probeend(ProbeCookie);
+}
+
+void
+cleanup(void) {
+	char *rm[] = { "rm", "-rf", NULL, NULL };
+
+	waitcookies();
+	if(compacter)
+		g_thread_join(compacter);
+	/* quitting keeps the session for surf -r, closing the last window
+	 * does not */
+	if(sessioner) {
+		g_source_remove(sessioner);
+		savesession(NULL);
+	}
+	quitting = TRUE;
+	if(dlwriter) {
+		g_source_remove(dlwriter);
+		writedownloads(NULL);
+	}
+	while(clients)
+		destroyclient(clients);
+	if(benchdir) {
+		rm[2] = benchdir;
+		g_spawn_sync(NULL, rm, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL,
+				NULL, NULL, NULL, NULL);
+	}
+	if(getenv("SURF_STATS"))
+		dumpstats(stderr);
+	g_free(cookiefile);
+	g_free(dldir);
+	g_free(scriptfile);
+	g_free(stylefile);
+	/* finishes the pending stores */
+	if(cachepool)
+		g_thread_pool_free(cachepool, FALSE, TRUE);
+	g_free(cachedir);
+	g_free(blockfile);
+	g_free(sitefile);
+	if(siteindex)
+		munmap(siteindex, sitesize);
+	g_free(histfile);
+	if(histindex)
+		munmap(histindex, histsize);
+	g_free(sessionpath);
+	if(blockindex)
+		munmap(blockindex, blocksize);
+	g_free(statsfile);
+	if(sock >= 0) {
+		close(sock);
+		unlink(sockpath);
+		g_free(sockpath);
+	}
+}
+
+void
+clipboard(Client *c, const Arg *arg) {
+	gboolean paste = *(gboolean *)arg;
+
+	if(paste)
+		gtk_clipboard_request_text(gtk_clipboard_get(GDK_SELECTION_PRIMARY), pasteuri, c);
+	else
+		gtk_clipboard_set_text(gtk_clipboard_get(GDK_SELECTION_PRIMARY), c->linkhover ? c->linkhover : geturi(c), -1);
+}
+
+void
+context(WebKitWebView *v, GtkMenu *m, Client *c) {
+	int i;
+	GtkContainer *parent;
+
+	gtk_widget_hide_all(GTK_WIDGET(m));
+	gtk_widget_show(GTK_WIDGET(m));
+	for(i = 0; i < LENGTH(items); i++) {
+		parent = GTK_CONTAINER(gtk_widget_get_parent(c->items[i]));
+		if(parent)
+			gtk_container_remove(parent, c->items[i]);
+		gtk_menu_shell_append(GTK_MENU_SHELL(m), c->items[i]);
+		gtk_widget_show(c->items[i]);
+	}
+}
+
+void
+closeprompt(Client *c) {
+	gtk_widget_hide(c->prompt);
+	if(c->view)
+		gtk_widget_grab_focus(GTK_WIDGET(c->view));
+}
+
+int
+cmpdouble(const void *a, const void *b) {
+	gdouble d = *(const gdouble *)a - *(const gdouble *)b;
+
+	return d < 0 ? -1 : d > 0;
+}
+
+int
+cmphistkey(const void *a, const void *b) {
+	return strcmp(histkey(((HistItem *)a)->uri), histkey(((HistItem *)b)->uri));
+}
+
+int
+cmphistscore(const void *a, const void *b) {
+	float d = ((HistItem *)b)->score - ((HistItem *)a)->score;
+
+	return d < 0 ? -1 : d > 0;
+}
+
+int
+cmpkey(const void *a, const void *b) {
+	guint x = *(const guint *)a, y = *(const guint *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int
+cmpentry(const void *a, const void *b) {
+	time_t d = ((const CacheEntry *)a)->mtime - ((const CacheEntry *)b)->mtime;
+
+	return d < 0 ? -1 : d > 0;
+}
+
+/* starts a compaction of the cookie journal in a thread, one per journal
+ * generation */
+void
+compactcookies(void) {
+	struct stat st;
+	Compaction *k;
+
+	if(compacter || stat(cookiefile, &st) < 0 || st.st_ino == compactino)
+		return;
+	compactino = st.st_ino;
+	k = g_new0(Compaction, 1);
+	if(!(compacter = g_thread_create(compactjournal, k, TRUE, NULL)))
+		g_free(k);
+}
+
+/* moves the read position into the compacted journal */
+gboolean
+compactdone(gpointer d) {
+	Compaction *k = d;
+
+	g_thread_join(compacter);
+	compacter = NULL;
+	if(k->newino) {
+		compactino = k->newino;
+		cookiestale = 0;
+		if(cookieino == k->ino && cookieoff >= k->read) {
+			cookieino = k->newino;
+			cookieoff += k->written - k->read;
+		}
+		else if(cookieino == k->ino)
+			cookieino = cookieoff = 0;
+	}
+	g_free(k);
+	return FALSE;
+}
+
+/* rewrites the cookie journal without stale entries. Lines appended
+ * meanwhile are copied over while the lock is held for the rename, so
+ * no other process waits for the rewrite itself */
+gpointer
+compactjournal(gpointer d) {
+	int fd, lockfd = -1, tmpfd;
+	char *data = NULL, *tail = NULL, *tmp, *line;
+	gboolean ok;
+	Compaction *k = d;
+	FILE *f = NULL;
+	GHashTable *live;
+	GHashTableIter i;
+	gpointer c;
+	struct stat st;
+	ssize_t n = -1;
+
+	if((fd = open(cookiefile, O_RDONLY)) >= 0 && fstat(fd, &st) == 0) {
+		k->ino = st.st_ino;
+		data = g_malloc(st.st_size + 1);
+		n = pread(fd, data, st.st_size, 0);
+	}
+	tmp = g_strconcat(cookiefile, ".XXXXXX", NULL);
+	if(n >= 0 && (tmpfd = g_mkstemp(tmp)) >= 0 && !(f = fdopen(tmpfd, "w"))) {
+		close(tmpfd);
+		unlink(tmp);
+	}
+	if(f) {
+		data[n] = '\0';
+		/* a line still being written goes with the tail */
+		if((line = strrchr(data, '\n')))
+			line[1] = '\0';
+		else
+			data[0] = '\0';
+		k->read = strlen(data);
+		live = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+				(GDestroyNotify)soup_cookie_free);
+		replaycookies(data, live);
+		g_hash_table_iter_init(&i, live);
+		while(g_hash_table_iter_next(&i, NULL, &c)) {
+			line = cookieline((SoupCookie *)c,
+					soup_date_to_time_t(((SoupCookie *)c)->expires));
+			fputs(line, f);
+			g_free(line);
+		}
+		g_hash_table_destroy(live);
+		k->written = ftell(f);
+		/* another process may have compacted first */
+		ok = fflush(f) == 0 && (lockfd = opencookies()) >= 0
+			&& fstat(lockfd, &st) == 0 && st.st_ino == k->ino;
+		if(ok && st.st_size > k->read) {
+			tail = g_malloc(st.st_size - k->read);
+			ok = pread(fd, tail, st.st_size - k->read, k->read)
+				== st.st_size - k->read
+				&& fwrite(tail, 1, st.st_size - k->read, f)
+				== st.st_size - k->read;
+		}
+		if(fclose(f) == 0 && ok && stat(tmp, &st) == 0
+				&& rename(tmp, cookiefile) == 0)
+			k->newino = st.st_ino;
+		else
+			unlink(tmp);
+		if(lockfd >= 0)
+			close(lockfd);
+	}
+	if(fd >= 0)
+		close(fd);
+	g_free(tmp);
+	g_free(data);
+	g_free(tail);
+	g_idle_add(compactdone, k);
+	return NULL;
+}
+
+/* the connection msg was busy with becomes idle */
+void
+connidle(SoupMessage *msg) {
+	Conn *cn;
+
+	if(!(cn = g_object_get_data(G_OBJECT(msg), "conn")))
+		return;
+	cn->msg = NULL;
+	cn->pool->busy--;
+	g_object_set_data(G_OBJECT(msg), "conn", NULL);
+}
+
+/* executes one control socket command, see surf(1) */
+char *
+control(char *cmd) {
+	char *arg;
+	guint xid;
+	Client *c;
+	Arg a;
+	GString *l;
+
+	if((arg = strchr(cmd, ' ')))
+		*arg++ = '\0';
+	if(!strcmp(cmd, "open")) {
+		c = newclient(FALSE);
+		if(arg && *arg) {
+			a.v = arg;
+			loaduri(c, &a);
+		}
+		return g_strdup_printf("ok %u",
+				(guint)GDK_WINDOW_XID(GTK_WIDGET(c->win)->window));
+	}
+	if(!strcmp(cmd, "downloads"))
+		return listdownloads();
+	if(!strcmp(cmd, "pool"))
+		return listpools();
+	if(!strcmp(cmd, "list")) {
+		l = g_string_new("ok");
+		for(c = clients; c; c = c->next)
+			g_string_append_printf(l, " %u",
+					(guint)GDK_WINDOW_XID(GTK_WIDGET(c->win)->window));
+		return g_string_free(l, FALSE);
+	}
+	xid = arg ? strtoul(arg, &arg, 10) : 0;
+	if(!(c = getclient(xid)))
+		return g_strdup("error no such window");
+	if(*arg == ' ')
+		arg++;
+	if(!strcmp(cmd, "load") && *arg) {
+		a.v = arg;
+		loaduri(c, &a);
+	}
+	else if(!strcmp(cmd, "find")) {
+		c->needle = copystr(&c->needle, arg);
+		a.b = TRUE;
+		find(c, &a);
+	}
+	else if(!strcmp(cmd, "reload")) {
+		a.b = FALSE;
+		reload(c, &a);
+	}
+	else if(!strcmp(cmd, "uri"))
+		return g_strconcat("ok ", geturi(c), NULL);
+	else if(!strcmp(cmd, "title"))
+		return g_strconcat("ok ", c->title ? c->title : "", NULL);
+	else if(!strcmp(cmd, "progress"))
+		return g_strdup_printf("ok %d", c->progress);
+	else
+		return g_strdup("error unknown command");
+	return g_strdup("ok");
+}
+
+char *
+cookieline(SoupCookie *c, time_t expires) {
+	/* curl marks HttpOnly cookies by prefixing the domain */
+	return g_strdup_printf("%s%s\t%s\t%s\t%s\t%lu\t%s\t%s\n",
+			c->http_only ? "#HttpOnly_" : "", c->domain, c->domain[0] == '.' ? "TRUE" : "FALSE",
+			c->path, c->secure ? "TRUE" : "FALSE",
+			(unsigned long)expires, c->name, c->value);
+}
+
+char *
+copystr(char **str, const char *src) {
+	char *tmp;
+	tmp = g_strdup(src);
+
+	if(str && *str) {
+		g_free(*str);
+		*str = tmp;
+	}
+	return tmp;
+}
+
+void
+createpath(const char *apath) {
+	char *dir, *p;
+	FILE *f;
+
+	/* creating directory */
+	dir = g_strdup(apath);
+	if((p = strrchr(dir, '/'))) {
+		*p = '\0';
+		g_mkdir_with_parents(dir, 0755);
+	}
+	g_free(dir);
+	/* creating file (gives error when apath ends with "/") */
+	if((f = g_fopen(apath, "a")))
+		fclose(f);
+}
+
+WebKitWebView *
+createwindow(WebKitWebView  *v, WebKitWebFrame *f, Client *c) {
+	Client *n = newclient(FALSE);
+	return n->view;
+}
+
+gboolean
+decidedownload(WebKitWebView *v, WebKitWebFrame *f, WebKitNetworkRequest *r, gchar *m,  WebKitWebPolicyDecision *p, Client *c) {
+	if(!webkit_web_view_can_show_mime_type(v, m)) {
+		webkit_web_policy_decision_download(p);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* applies the settings of the site before its main frame is requested */
+gboolean
+decidenavigation(WebKitWebView *view, WebKitWebFrame *f, WebKitNetworkRequest *r, WebKitWebNavigationAction *n, WebKitWebPolicyDecision *p, Client *c) {
+	if(f == webkit_web_view_get_main_frame(view)) {
+		loadsites();
+		setsite(c, sitesettings(webkit_network_request_get_uri(r)));
+	}
+	return FALSE;
+}
+
+gboolean
+decidewindow(WebKitWebView *view, WebKitWebFrame *f, WebKitNetworkRequest *r, WebKitWebNavigationAction *n, WebKitWebPolicyDecision *p, Client *c) {
+	Arg arg;
+
+	if(webkit_web_navigation_action_get_reason(n) == WEBKIT_WEB_NAVIGATION_REASON_LINK_CLICKED) {
+		webkit_web_policy_decision_ignore(p);
+		arg.v = (void *)webkit_network_request_get_uri(r);
+		newwindow(NULL, &arg);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* the setup work no window needs, run once the first window is mapped
+ * and its first request is in flight */
+gboolean
+deferred(gpointer d) {
+	Client *c;
+
+	if(started)
+		return FALSE;
+	started = TRUE;
+	waitcookies();
+	createpath(cookiefile);
+	createpath(dldir);
+	createpath(scriptfile);
+	createpath(stylefile);
+	createpath(cachedir);
+	createpath(blockfile);
+	createpath(sitefile);
+	createpath(statsfile);
+	if(histfile)
+		createpath(histfile);
+	if(sessionpath)
+		createpath(sessiondir);
+	if(discardtime > 0)
+		g_timeout_add_seconds(MAX(discardtime / 10, 1), discardidle, NULL);
+	if(pressureinterval > 0 && g_file_test(pressurepath, G_FILE_TEST_EXISTS))
+		g_timeout_add_seconds(pressureinterval, governor, NULL);
+	if(zygote < 0 && !benchjobs)
+		fillpool(NULL);
+	profilemark("deferred", profiletime());
+	for(c = clients; c && !(c->view && c->uri); c = c->next);
+	if(!c)
+		profilereport();
+	return FALSE;
+}
+
+void
+destroyclient(Client *c) {
+	int i;
+	Client *p;
+	Download *d;
+
+	for(d = downloads; d; d = d->next)
+		if(d->c == c)
+			d->c = NULL;
+	if(c->updater)
+		g_source_remove(c->updater);
+	if(c->hoverer)
+		g_source_remove(c->hoverer);
+	if(c->speculation)
+		soup_session_cancel_message(session, c->speculation, SOUP_STATUS_CANCELLED);
+	if(c->gc)
+		g_object_unref(c->gc);
+	g_free(c->wintitle);
+	g_free(c->uri);
+	g_free(c->needle);
+	g_free(c->site);
+	g_free(c->histuri);
+	g_free(c->histtitle);
+	for(i = 0; i < c->nhist; i++)
+		g_object_unref(c->hist[i]);
+	g_free(c->hist);
+	gtk_widget_destroy(c->indicator);
+	if(c->view)
+		gtk_widget_destroy(GTK_WIDGET(c->view));
+	gtk_widget_destroy(c->scroll);
+	gtk_widget_destroy(c->vbox);
+	gtk_widget_destroy(c->win);
+	for(i = 0; i < LENGTH(items); i++)
+		gtk_widget_destroy(c->items[i]);
+	free(c->items);
+
+	for(p = clients; p && p->next != c; p = p->next);
+	if(p)
+		p->next = c->next;
+	else
+		clients = c->next;
+	free(c);
+	setcachemodel();
+	if(sessionpath && !quitting) {
+		if(sessioner)
+			g_source_remove(sessioner);
+		savesession(NULL);
+	}
+	/* running downloads keep the process alive */
+	if(clients == NULL && downloads == NULL)
+		gtk_main_quit();
+}
+
+void
+destroywin(GtkWidget* w, Client *c) {
+	destroyclient(c);
+}
+
+void
+die(char *str) {
+	fputs(str, stderr);
+	exit(EXIT_FAILURE);
+}
+
+/* keeps history, scroll position and zoom of c and frees its view with
+ * the page, restoreclient brings it back */
+void
+discardclient(Client *c) {
+	int i, back;
+	WebKitWebBackForwardList *l;
+	GtkScrolledWindow *sw;
+
+	l = webkit_web_view_get_back_forward_list(c->view);
+	if(!webkit_web_back_forward_list_get_current_item(l))
+		return;
+	back = webkit_web_back_forward_list_get_back_length(l);
+	c->curhist = back;
+	c->nhist = back + 1 + webkit_web_back_forward_list_get_forward_length(l);
+	c->hist = g_new(WebKitWebHistoryItem *, c->nhist);
+	for(i = 0; i < c->nhist; i++)
+		c->hist[i] = g_object_ref(webkit_web_back_forward_list_get_nth_item(l, i - back));
+	sw = GTK_SCROLLED_WINDOW(c->scroll);
+	c->scrollx = gtk_adjustment_get_value(gtk_scrolled_window_get_hadjustment(sw));
+	c->scrolly = gtk_adjustment_get_value(gtk_scrolled_window_get_vadjustment(sw));
+	c->zoomlevel = webkit_web_view_get_zoom_level(c->view);
+	gtk_widget_destroy(GTK_WIDGET(c->view));
+	c->view = NULL;
+}
+
+/* discards windows which were not focused for discardtime seconds */
+gboolean
+discardidle(gpointer d) {
+	Client *c;
+	time_t now = time(NULL);
+
+	for(c = clients; c; c = c->next)
+		if(c->view && !c->focused && c->progress == 100
+				&& now - c->idle >= discardtime)
+			discardclient(c);
+	return TRUE;
+}
+
+/* deletes the session files restoresession() took over once this
+ * process' own session holds their windows */
+void
+droprestored(void) {
+	for(; restored; restored = g_slist_delete_link(restored, restored)) {
+		if(!sessionpath || strcmp(restored->data, sessionpath))
+			unlink(restored->data);
+		g_free(restored->data);
+	}
+}
+
+/* handler latency histograms and counters as tab separated values */
+void
+dumpstats(FILE *f) {
+	int i, j;
+	gpointer k, v;
+	GHashTableIter it;
+	Pool *p;
+
+	fprintf(f, "# surf %d\n", (int)getpid());
+	fprintf(f, "cookies\t%d reloads\t%d syncs\t%d skipped\n",
+			cookiereloads, cookiesyncs, cookieskips);
+	for(i = 0; i < CountLast; i++)
+		fprintf(f, "%s\t%u\n", countnames[i], counts[i]);
+	fputs("handler\tn\tmean\tmax", f);
+	for(j = 0; j < LENGTH(probelimits); j++)
+		fprintf(f, "\t<%g", probelimits[j]);
+	fputs("\tmore\n", f);
+	for(i = 0; i < ProbeLast; i++) {
+		fprintf(f, "%s\t%u\t%.3f\t%.3f", probes[i].name, probes[i].n,
+				probes[i].n ? probes[i].total / probes[i].n : 0,
+				probes[i].max);
+		for(j = 0; j < LENGTH(probes[i].hist); j++)
+			fprintf(f, "\t%u", probes[i].hist[j]);
+		fputc('\n', f);
+	}
+	fputs("host\topen\tidle\tqueued\trequests\n", f);
+	g_hash_table_iter_init(&it, pools);
+	while(g_hash_table_iter_next(&it, &k, &v)) {
+		p = v;
+		fprintf(f, "%s\t%d\t%d\t%d\t%u\n", (char *)k, p->open,
+				p->open - p->busy, p->queued, p->requests);
+	}
+}
+
+void
+download(Client *c, const Arg *arg) {
+	char *uri;
+	WebKitNetworkRequest *r;
+	WebKitDownload       *dl;
+
+	if(arg->v)
+		uri = (char *)arg->v;
+	else
+		uri = c->linkhover ? c->linkhover : geturi(c);
+	r = webkit_network_request_new(uri);
+	dl = webkit_download_new(r);
+	if(!initdownload(c->view, dl, c))
+		g_object_unref(dl);
+	g_object_unref(r);
+}
+
+/* percent done, bytes/s and the file, or queued */
+char *
+downloadline(Download *d) {
+	int i, pc;
+	goffset done;
+	gdouble t;
+
+	if(d->dl) {
+		t = webkit_download_get_elapsed_time(d->dl);
+		pc = webkit_download_get_progress(d->dl) * 100;
+		done = webkit_download_get_current_size(d->dl);
+	}
+	else {
+		t = d->timer ? g_timer_elapsed(d->timer, NULL) : 0;
+		for(i = 0, done = 0; i < d->nseg; i++)
+			done += d->seg[i].pos - d->seg[i].start;
+		pc = d->total > 0 ? done * 100 / d->total : 0;
+		done = d->received;
+	}
+	return g_strdup_printf("%d %.0f %s", pc, t > 0 ? done / t : 0,
+			d->file ? d->file : "queued");
+}
+
+/* draws only the part of the bar that changed since the last call */
+void
+drawindicator(Client *c) {
+	gint width;
+	GtkWidget *w;
+
+	w = c->indicator;
+	if(!w->window || c->hidden)
+		return;
+	probebegin(ProbeIndicator);
+	if(!c->gc) {
+		c->gc = gdk_gc_new(w->window);
+		gdk_gc_set_rgb_fg_color(c->gc, c->trusted ? &trustcolor : &progresscolor);
+	}
+	width = c->progress * w->allocation.width / 100;
+	if(width > c->drawn)
+		gdk_draw_rectangle(w->window, c->gc, TRUE, c->drawn, 0,
+				width - c->drawn, w->allocation.height);
+	else if(width < c->drawn)
+		gdk_draw_rectangle(w->window,
+				w->style->bg_gc[GTK_WIDGET_STATE(w)],
+				TRUE, width, 0, c->drawn - width,
+				w->allocation.height);
+	c->drawn = width;
+	probeend(ProbeIndicator);
+}
+
+/* finishes a download, incomplete ones stay resumable when ranges work */
+void
+enddownload(Download *d) {
+	int i;
+	char *part, *state;
+	Download **p;
+
+	for(p = &downloads; *p && *p != d; p = &(*p)->next);
+	if(*p)
+		*p = d->next;
+	if(d->dl) {
+		g_signal_handler_disconnect(d->dl, d->handler);
+		g_object_unref(d->dl);
+	}
+	else if(d->file) {
+		close(d->fd);
+		for(i = 0; i < d->nseg && d->seg[i].pos >= d->seg[i].end; i++);
+		part = g_strconcat(d->file, ".part", NULL);
+		state = g_strconcat(d->file, ".state", NULL);
+		if(!d->failed && i == d->nseg) {
+			rename(part, d->file);
+			unlink(state);
+		}
+		else if(d->ranges)
+			savedownload(d);
+		else {
+			unlink(part);
+			unlink(state);
+		}
+		if(d->failed)
+			fprintf(stderr, "surf: download of %s stopped\n", d->uri);
+		g_free(part);
+		g_free(state);
+		if(d->timer)
+			g_timer_destroy(d->timer);
+	}
+	g_free(d->seg);
+	g_free(d->uri);
+	g_free(d->name);
+	g_free(d->file);
+	g_free(d->validator);
+	g_free(d->referer);
+	free(d);
+	startdownloads();
+	if(!clients && !downloads)
+		gtk_main_quit();
+}
+
+char *
+expandpath(const char *path) {
+	if(path[0] == '/')
+		return g_strdup(path);
+	return g_strconcat(g_get_home_dir(), "/", path, NULL);
+}
+
+gboolean
+exposeindicator(GtkWidget *w, GdkEventExpose *e, Client *c) {
+	sethidden(c, FALSE);
+	gdk_draw_rectangle(w->window, w->style->bg_gc[GTK_WIDGET_STATE(w)],
+			TRUE, 0, 0, w->allocation.width, w->allocation.height);
+	c->drawn = 0;
+	drawindicator(c);
+	return TRUE;
+}
+
+/* cancels the running segments and ends the download once, after the
+ * last of them. The segmentdone() calls nested in the cancellation see
+ * d->ending and leave d alone. */
+void
+faildownload(Download *d) {
+	int i, j, n = 0;
+	SoupMessage **msgs;
+
+	d->failed = TRUE;
+	msgs = g_new(SoupMessage *, d->nseg + 1);
+	for(i = 0; i < d->nseg; i++)
+		if(d->seg[i].msg)
+			msgs[n++] = g_object_ref(d->seg[i].msg);
+	d->ending++;
+	for(i = 0; i < n; i++) {
+		/* an earlier cancellation may have finished it already */
+		for(j = 0; j < d->nseg && d->seg[j].msg != msgs[i]; j++);
+		if(j < d->nseg)
+			soup_session_cancel_message(session, msgs[i], SOUP_STATUS_CANCELLED);
+		g_object_unref(msgs[i]);
+	}
+	d->ending--;
+	g_free(msgs);
+	if(!d->ending && !d->running)
+		enddownload(d);
+}
+
+/* keeps zygotes pre-initialised surf processes waiting for a window */
+gboolean
+fillpool(gpointer d) {
+	int fd[2];
+	char tmp[16];
+	const char *cmd[] = { progname, "-w", tmp, NULL };
+	const Arg a = { .v = (void *)cmd };
+
+	while(!single && nwarm < zygotes && pipe(fd) == 0) {
+		fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+		snprintf(tmp, LENGTH(tmp), "%d", fd[0]);
+		spawn(NULL, &a);
+		close(fd[0]);
+		warm[nwarm++] = fd[1];
+	}
+	return FALSE;
+}
+
+void
+find(Client *c, const Arg *arg) {
+	gboolean forward = *(gboolean *)arg;
+
+	restoreclient(c, TRUE);
+	webkit_web_view_search_text(c->view, c->needle ? c->needle : "",
+			FALSE, forward, TRUE);
+}
+
+/* drops the memory and page caches by shrinking them to nothing and
+ * collects the script heaps of all windows. The document viewer model is
+ * the minimal one of WebKit, it has no page cache and no capacity for
+ * dead resources. */
+void
+flushmemory(const char *why) {
+	int n = 0;
+	Client *c;
+
+	webkit_set_cache_model(WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER);
+	setcachemodel();
+	for(c = clients; c; c = c->next)
+		if(c->view) {
+			JSGarbageCollect(webkit_web_frame_get_global_context(
+					webkit_web_view_get_main_frame(c->view)));
+			n++;
+		}
+	counts[CountFlushes]++;
+	lastflush = time(NULL);
+	fprintf(stderr, "surf: %s: flushed caches, collected %d script heaps\n",
+			why, n);
+}
+
+gboolean
+focusin(GtkWidget *w, GdkEventFocus *e, Client *c) {
+	c->focused = TRUE;
+	restoreclient(c, TRUE);
+	return FALSE;
+}
+
+gboolean
+focusout(GtkWidget *w, GdkEventFocus *e, Client *c) {
+	c->focused = FALSE;
+	c->idle = time(NULL);
+	return FALSE;
+}
+
+const char *
+getatom(Client *c, Atom a) {
+	static char buf[BUFSIZ];
+	Atom adummy;
+	int idummy;
+	unsigned long ldummy;
+	unsigned char *p = NULL;
+
+	counts[CountXRoundTrips]++;
+	XGetWindowProperty(dpy, GDK_WINDOW_XID(GTK_WIDGET(c->win)->window),
+			a, 0L, BUFSIZ, False, XA_STRING,
+			&adummy, &idummy, &ldummy, &ldummy, &p);
+	if(p)
+		strncpy(buf, (char *)p, LENGTH(buf)-1);
+	else
+		buf[0] = '\0';
+	XFree(p);
+	return buf;
+}
+
+Client *
+getclient(guint xid) {
+	Client *c;
+
+	for(c = clients; c; c = c->next)
+		if(GDK_WINDOW_XID(GTK_WIDGET(c->win)->window) == xid)
+			break;
+	return c;
+}
+
+/* returns the pool of host and port, which the caller refers to */
+Pool *
+findpool(const char *host, guint port) {
+	char *key;
+	Pool *p;
+
+	key = g_strdup_printf("%s:%u", host, port);
+	if(!(p = g_hash_table_lookup(pools, key))) {
+		p = g_new0(Pool, 1);
+		p->key = key;
+		g_hash_table_insert(pools, key, p);
+	}
+	else
+		g_free(key);
+	p->refs++;
+	return p;
+}
+
+/* returns the pool of the host msg goes to, until msg is unqueued */
+Pool *
+getpool(SoupMessage *msg) {
+	Pool *p;
+	SoupURI *u;
+
+	if((p = g_object_get_data(G_OBJECT(msg), "pool")))
+		return p;
+	u = soup_message_get_uri(msg);
+	p = findpool(u->host, u->port);
+	g_object_set_data(G_OBJECT(msg), "pool", p);
+	return p;
+}
+
+JSValueRef
+gethidden(JSContextRef js, JSObjectRef o, JSStringRef name, JSValueRef *e) {
+	Client *c = JSObjectGetPrivate(o);
+
+	return JSValueMakeBoolean(js, c && c->hidden);
+}
+
+char *
+geturi(Client *c) {
+	char *uri;
+
+	if(!c->view)
+		uri = c->uri;
+	else
+		uri = (char *)webkit_web_view_get_uri(c->view);
+	return uri ? uri : "about:blank";
+}
+
+void
+gotchunk(SoupMessage *msg, SoupBuffer *chunk, Segment *s) {
+	goffset len;
+	Download *d = s->d;
+
+	if(msg->status_code != SOUP_STATUS_OK
+			&& msg->status_code != SOUP_STATUS_PARTIAL_CONTENT)
+		return;
+	len = chunk->length;
+	if(s->end >= 0 && s->pos + len > s->end)
+		len = s->end - s->pos;
+	if(len > 0 && pwrite(d->fd, chunk->data, len, s->pos) != len) {
+		faildownload(d);
+		return;
+	}
+	s->pos += len;
+	d->received += len;
+	if(s->end >= 0 && s->pos >= s->end)
+		soup_session_cancel_message(session, msg, SOUP_STATUS_CANCELLED);
+	else if(d->saved != time(NULL))
+		savedownload(d);
+}
+
+/* splits the download into ranges once the server has shown it supports
+ * them, otherwise the first response becomes the only stream. A range of
+ * a different entity than the saved one spoils the partial file. */
+void
+gotheaders(SoupMessage *msg, Segment *s) {
+	int i, n;
+	goffset start, end, total, size;
+	const char *v;
+	Download *d = s->d;
+
+	if(!(v = soup_message_headers_get(msg->response_headers, "ETag"))
+			|| g_str_has_prefix(v, "W/"))
+		v = soup_message_headers_get(msg->response_headers, "Last-Modified");
+	if(msg->status_code == SOUP_STATUS_PARTIAL_CONTENT
+			&& soup_message_headers_get_content_range(msg->response_headers,
+				&start, &end, &total)) {
+		if((d->total > 0 && total != d->total)
+				|| (d->validator && (!v || strcmp(v, d->validator))))
+			d->ranges = FALSE;
+		else if(start == s->pos)
+			d->ranges = TRUE;
+		if(start != s->pos || !d->ranges) {
+			faildownload(d);
+			return;
+		}
+		if(!d->validator && v)
+			d->validator = g_strdup(v);
+		if(s->end >= 0 || total <= 0)
+			return;
+		d->total = total;
+		n = MAX(1, MIN(segments, total / (64 * 1024)));
+		size = total / n;
+		s->end = n > 1 ? size : total;
+		for(i = 1; i < n; i++) {
+			d->seg[i].d = d;
+			d->seg[i].start = d->seg[i].pos = i * size;
+			d->seg[i].end = i == n - 1 ? total : (i + 1) * size;
+			startsegment(&d->seg[i]);
+		}
+		d->nseg = n;
+		savedownload(d);
+	}
+	else if(msg->status_code == SOUP_STATUS_OK) {
+		/* the entity changed or ranges are ignored, start over */
+		d->ranges = FALSE;
+		g_free(d->validator);
+		d->validator = g_strdup(v);
+		for(i = 0; i < d->nseg; i++) {
+			if(&d->seg[i] == s)
+				continue;
+			d->seg[i].start = d->seg[i].pos = d->seg[i].end = 0;
+			if(d->seg[i].msg)
+				soup_session_cancel_message(session, d->seg[i].msg, SOUP_STATUS_CANCELLED);
+		}
+		s->start = s->pos = 0;
+		s->end = d->total = soup_message_headers_get_content_length(msg->response_headers);
+		if(s->end <= 0)
+			s->end = -1;
+		if(ftruncate(d->fd, 0) < 0)
+			d->failed = TRUE;
+	}
+}
+
+gboolean
+governor(gpointer d) {
+	if(readpressure() && time(NULL) - lastflush >= pressurecooldown)
+		flushmemory("memory pressure");
+	return TRUE;
+}
+
+/* adds a "v\ttime\turi" visit, a "v\ttime\turi\tvisits" line of a
+ * compacted log or a "t\turi\ttitle" line to items, which keep pointers
+ * into the line */
+void
+histadd(GHashTable *items, char *line) {
+	char *a, *b, *n;
+	guint visits = 1;
+	HistItem *h;
+
+	if((line[0] != 'v' && line[0] != 't') || line[1] != '\t'
+			|| !(b = strchr(a = line + 2, '\t')))
+		return;
+	*b++ = '\0';
+	if(line[0] == 'v' && (n = strchr(b, '\t'))) {
+		*n++ = '\0';
+		visits = strtoul(n, NULL, 10);
+	}
+	if(!(h = g_hash_table_lookup(items, line[0] == 'v' ? b : a))) {
+		h = g_new0(HistItem, 1);
+		h->uri = line[0] == 'v' ? b : a;
+		g_hash_table_insert(items, h->uri, h);
+	}
+	if(line[0] == 't')
+		h->title = b;
+	else {
+		h->visits += visits;
+		h->last = MAX(h->last, strtol(a, NULL, 10));
+	}
+}
+
+/* rebuilds the index in a thread for histmap(), which keeps using the
+ * old one meanwhile */
+gpointer
+histbuild(gpointer d) {
+	buildhistory(histfile, d);
+	g_free(d);
+	g_atomic_int_set(&histbuilding, 0);
+	return NULL;
+}
+
+void
+histfree(HistItem *items, int n) {
+	int i;
+
+	for(i = 0; i < n; i++) {
+		g_free(items[i].uri);
+		g_free(items[i].title);
+	}
+	g_free(items);
+}
+
+/* what queries match against: the uri without scheme and www. */
+const char *
+histkey(const char *uri) {
+	const char *p;
+
+	if((p = strstr(uri, "://")))
+		uri = p + 3;
+	if(g_str_has_prefix(uri, "www."))
+		uri += 4;
+	return uri;
+}
+
+/* the visits logged after the index. They are parsed once and only the
+ * lines appended since are read on later calls, the items keep pointers
+ * into histchunks */
+GHashTable *
+histlog(void) {
+	int fd;
+	char *buf, *p, *e;
+	off_t from;
+	ssize_t n;
+	struct stat st;
+
+	from = histindex ? histindex->logsize : 0;
+	if((fd = open(histfile, O_RDONLY)) < 0)
+		return histitems;
+	if(fstat(fd, &st) < 0) {
+		close(fd);
+		return histitems;
+	}
+	/* a new index or a compacted log starts over */
+	if(!histitems || st.st_ino != histlogino || from != histlogfrom
+			|| st.st_size < histlogend) {
+		if(histitems)
+			g_hash_table_destroy(histitems);
+		g_slist_foreach(histchunks, (GFunc)g_free, NULL);
+		g_slist_free(histchunks);
+		histchunks = NULL;
+		histitems = g_hash_table_new_full(g_str_hash, g_str_equal,
+				NULL, g_free);
+		histlogino = st.st_ino;
+		histlogfrom = histlogend = from;
+	}
+	if(st.st_size > histlogend) {
+		buf = g_malloc(st.st_size - histlogend + 1);
+		n = pread(fd, buf, st.st_size - histlogend, histlogend);
+		buf[MAX(n, 0)] = '\0';
+		/* a line still being written is read next time */
+		if(n > 0 && (e = strrchr(buf, '\n'))) {
+			histlogend += e + 1 - buf;
+			for(p = buf; (e = strchr(p, '\n')); p = e + 1) {
+				*e = '\0';
+				histadd(histitems, p);
+			}
+			histchunks = g_slist_prepend(histchunks, buf);
+		}
+		else
+			g_free(buf);
+	}
+	close(fd);
+	return histitems;
+}
+
+/* maps the history index. It is rebuilt when more than histrebuild bytes
+ * or a day of visits were logged since: first when rebuild is set,
+ * otherwise in a thread while the old index answers */
+void
+histmap(gboolean rebuild) {
+	int fd, tries;
+	char *idx, *p;
+	gboolean current;
+	struct stat log, st;
+
+	if(!histfile || stat(histfile, &log) < 0 || log.st_size == 0)
+		return;
+	idx = g_strconcat(histfile, ".idx", NULL);
+	for(tries = 0; tries < 2; tries++) {
+		current = histindex && stat(idx, &st) == 0 && st.st_ino == histino
+			&& st.st_size == histsize && log.st_size >= histindex->logsize;
+		if(current && log.st_size - histindex->logsize <= histrebuild
+				&& (log.st_size == histindex->logsize
+					|| st.st_mtime + 86400 > time(NULL)))
+			break;
+		if((current || tries) && !rebuild) {
+			if(g_atomic_int_compare_and_exchange(&histbuilding, 0, 1)) {
+				p = g_strdup(idx);
+				if(!g_thread_create(histbuild, p, FALSE, NULL)) {
+					g_free(p);
+					histbuilding = 0;
+				}
+			}
+			break;
+		}
+		if(histindex)
+			munmap(histindex, histsize);
+		histindex = NULL;
+		if(tries && !buildhistory(histfile, idx))
+			break;
+		if((fd = open(idx, O_RDONLY)) >= 0 && fstat(fd, &st) == 0
+				&& st.st_size >= sizeof(HistHeader)
+				&& (histindex = mmap(NULL, st.st_size, PROT_READ,
+						MAP_SHARED, fd, 0)) == MAP_FAILED)
+			histindex = NULL;
+		if(fd >= 0)
+			close(fd);
+		if(!histindex)
+			continue;
+		histsize = st.st_size;
+		histino = st.st_ino;
+		histentries = (HistEntry *)(histindex + 1);
+		histranks = (guint32 *)(histentries + histindex->n);
+		histpool = (char *)(histranks + histindex->n);
+		if(strcmp(histindex->magic, "surfhi2")
+				|| histpool + histindex->poolsize
+				!= (char *)histindex + histsize) {
+			if(tries)
+				fputs("surf: invalid history index\n", stderr);
+			munmap(histindex, histsize);
+			histindex = NULL;
+		}
+	}
+	g_free(idx);
+}
+
+/* opens the history log locked with op. buildhistory() of another process
+ * may have replaced the file by the time the lock is held, then the new
+ * one is opened. */
+int
+histopen(const char *path, int op) {
+	int fd, tries;
+	struct stat a, b;
+
+	for(tries = 0; tries < 3; tries++) {
+		if((fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0600)) < 0)
+			return -1;
+		if(flock(fd, op) == 0 && fstat(fd, &a) == 0 && stat(path, &b) == 0
+				&& a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+			return fd;
+		close(fd);
+	}
+	return -1;
+}
+
+/* returns the n uris with the best frecency whose key starts with q. the
+ * matching keys of the index are found by binary search, a short range
+ * is ranked whole, a long one filtered in rank order. visits logged
+ * since the index was built are merged. */
+HistItem *
+histquery(const char *q, int n, int *found) {
+	int i, nres = 0, size;
+	guint32 lo = 0, hi = 0, a, b, m;
+	gboolean whole;
+	gsize len;
+	time_t now = time(NULL);
+	gpointer v;
+	GHashTable *items, *merged;
+	GHashTableIter it;
+	HistItem *res, *h;
+	HistEntry *he;
+
+	q = histkey(q);
+	len = strlen(q);
+	if(histindex) {
+		for(a = 0, b = histindex->n; a < b;) {
+			m = a + (b - a) / 2;
+			if(strncmp(histpool + histentries[m].key, q, len) < 0)
+				a = m + 1;
+			else
+				b = m;
+		}
+		for(lo = a, b = histindex->n; a < b;) {
+			m = a + (b - a) / 2;
+			if(strncmp(histpool + histentries[m].key, q, len) <= 0)
+				a = m + 1;
+			else
+				b = m;
+		}
+		hi = a;
+	}
+	/* ranking the range costs its length, filtering the ranks about
+	 * n * histindex->n / length */
+	whole = !histindex
+		|| (guint64)(hi - lo) * (hi - lo) <= (guint64)histindex->n * n;
+	size = whole ? MAX(n, hi - lo) : n;
+	res = g_new(HistItem, size);
+	for(i = 0; histindex && nres < size
+			&& i < (whole ? hi - lo : histindex->n); i++) {
+		if(whole)
+			he = &histentries[lo + i];
+		else if(histranks[i] >= lo && histranks[i] < hi)
+			he = &histentries[histranks[i]];
+		else
+			continue;
+		res[nres].uri = histpool + he->uri;
+		res[nres].title = histpool + he->title;
+		res[nres].visits = he->visits;
+		res[nres++].last = he->last;
+	}
+
+	merged = g_hash_table_new(g_direct_hash, g_direct_equal);
+	if((items = histlog())) {
+		for(i = 0; i < nres; i++)
+			if((h = g_hash_table_lookup(items, res[i].uri))) {
+				res[i].visits += h->visits;
+				res[i].last = MAX(res[i].last, h->last);
+				if(h->title)
+					res[i].title = h->title;
+				g_hash_table_insert(merged, h, h);
+			}
+		g_hash_table_iter_init(&it, items);
+		while(g_hash_table_iter_next(&it, NULL, &v)) {
+			h = v;
+			if(!h->visits || g_hash_table_lookup(merged, h)
+					|| strncmp(histkey(h->uri), q, len))
+				continue;
+			if(nres == size)
+				res = g_renew(HistItem, res, size *= 2);
+			res[nres++] = *h;
+		}
+	}
+	for(i = 0; i < nres; i++)
+		res[i].score = histscore(res[i].visits, res[i].last, now);
+	qsort(res, nres, sizeof *res, cmphistscore);
+
+	*found = nres = MIN(nres, n);
+	for(i = 0; i < nres; i++) {
+		res[i].uri = g_strdup(res[i].uri);
+		res[i].title = g_strdup(res[i].title ? res[i].title : "");
+	}
+	g_hash_table_destroy(merged);
+	return res;
+}
+
+/* appends a visit, or the title when one is given, to the history log
+ * in a single write */
+void
+histrecord(const char *uri, const char *title) {
+	int fd;
+	char *t, *line;
+
+	if(!histfile || !(g_str_has_prefix(uri, "http://")
+				|| g_str_has_prefix(uri, "https://")
+				|| g_str_has_prefix(uri, "file://")))
+		return;
+	if((fd = histopen(histfile, LOCK_SH)) < 0)
+		return;
+	if(title) {
+		t = g_strdelimit(g_strdup(title), "\t\r\n", ' ');
+		line = g_strdup_printf("t\t%s\t%s\n", uri, t);
+		g_free(t);
+	}
+	else
+		line = g_strdup_printf("v\t%ld\t%s\n", (long)time(NULL), uri);
+	if(write(fd, line, strlen(line)) < 0)
+		perror("surf: cannot write history");
+	close(fd);
+	g_free(line);
+}
+
+/* visits weighted by 1 / (1 + age in weeks): half after a week, a third
+ * after two */
+float
+histscore(guint visits, time_t last, time_t now) {
+	return visits / (1.0 + MAX(now - last, 0) / (7 * 86400.0));
+}
+
+/* queues the download, it does not touch the page. HTTP downloads are
+ * fetched by surf itself in ranges, the rest by WebKit. */
+gboolean
+initdownload(WebKitWebView *view, WebKitDownload *o, Client *c) {
+	const char *name;
+	Download *d, **p;
+	WebKitNetworkRequest *r;
+	SoupMessage *msg = NULL;
+
+	if(blocked(webkit_download_get_uri(o))) {
+		fprintf(stderr, "surf: blocked download %s\n",
+				webkit_download_get_uri(o));
+		return FALSE;
+	}
+	if(!(d = calloc(1, sizeof(Download))))
+		die("Cannot malloc!\n");
+	d->c = c;
+	d->fd = -1;
+	d->uri = g_strdup(webkit_download_get_uri(o));
+	name = webkit_download_get_suggested_filename(o);
+	d->name = g_strdup(name && *name ? name : "index.html");
+	if((r = webkit_download_get_network_request(o)))
+		msg = webkit_network_request_get_message(r);
+	/* only a plain GET can be repeated in ranges, WebKit keeps the rest */
+	if((g_str_has_prefix(d->uri, "http://") || g_str_has_prefix(d->uri, "https://"))
+			&& (!msg || (!strcmp(msg->method, "GET") && !msg->request_body->length))) {
+		if(msg && (name = soup_message_headers_get(msg->request_headers, "Referer")))
+			d->referer = g_strdup(name);
+	}
+	else {
+		d->dl = o;
+		d->handler = g_signal_connect(o, "notify::status", G_CALLBACK(updatedownload), d);
+	}
+	for(p = &downloads; *p; p = &(*p)->next);
+	*p = d;
+	/* WebKit starts a download with a destination itself once this
+	 * returns, and cancels and frees what surf fetches */
+	g_idle_add(startidle, NULL);
+	if(!dlwriter)
+		dlwriter = g_timeout_add_seconds(1, writedownloads, NULL);
+	return d->dl != NULL;
+}
+
+/* replaces the jar with the cookies read by parsecookies() */
+void
+installcookies(GHashTable *live) {
+	GSList *l, *e;
+	GHashTableIter i;
+	gpointer c;
+
+	lockcookie = TRUE;
+	for(l = e = soup_cookie_jar_all_cookies(cookies); e; e = e->next)
+		soup_cookie_jar_delete_cookie(cookies, (SoupCookie *)e->data);
+	soup_cookies_free(l);
+	g_hash_table_iter_init(&i, live);
+	while(g_hash_table_iter_next(&i, NULL, &c))
+		soup_cookie_jar_add_cookie(cookies, soup_cookie_copy(c));
+	lockcookie = FALSE;
+
+	cookiereloads++;
+	cookiestale = cookielines - g_hash_table_size(live);
+	if(cookiestale > cookiecompact)
+		compactcookies();
+	g_hash_table_destroy(live);
+}
+
+void
+itemclick(GtkMenuItem *mi, Client *c) {
+	int i;
+	const char *label;
+
+	label = gtk_menu_item_get_label(mi);
+	for(i = 0; i < LENGTH(items); i++)
+		if(!strcmp(items[i].label, label))
+			items[i].func(c, &(items[i].arg));
 }
 
 gboolean
@@ -396,7 +2840,16 @@ keypress(GtkWidget* w, GdkEventKey *ev, Client *c) {
 	guint i;
 	gboolean processed = FALSE;
 
+	probebegin(ProbeKeypress);
+	/* a prompt navigation that never made a request ends here */
+	c->prompted = 0;
+	restoreclient(c, TRUE);
 	updatewinid(c);
+	if(ev->keyval == GDK_Escape && GTK_WIDGET_VISIBLE(c->prompt)) {
+		closeprompt(c);
+		probeend(ProbeKeypress);
+		return TRUE;
+	}
 	for(i = 0; i < LENGTH(keys); i++) {
 		if(gdk_keyval_to_lower(ev->keyval) == keys[i].keyval
 				&& CLEANMASK(ev->state) == keys[i].mod
@@ -405,11 +2858,20 @@ keypress(GtkWidget* w, GdkEventKey *ev, Client *c) {
 			processed = TRUE;
 		}
 	}
+	probeend(ProbeKeypress);
 	return processed;
 }
 
 void
 linkhover(WebKitWebView *v, const char* t, const char* l, Client *c) {
+	if(c->hoverer) {
+		g_source_remove(c->hoverer);
+		c->hoverer = 0;
+	}
+	if(c->speculation)
+		soup_session_cancel_message(session, c->speculation, SOUP_STATUS_CANCELLED);
+	if(l && hoverdelay > 0)
+		c->hoverer = g_timeout_add(hoverdelay, speculate, c);
 	if(l)
 		c->linkhover = copystr(&c->linkhover, l);
 	else if(c->linkhover) {
@@ -419,16 +2881,195 @@ linkhover(WebKitWebView *v, const char* t, const char* l, Client *c) {
 	update(c);
 }
 
+/* one tab separated entry per download: percent, bytes/s, file */
+char *
+listdownloads(void) {
+	char *line;
+	Download *d;
+	GString *l;
+
+	l = g_string_new("ok");
+	for(d = downloads; d; d = d->next) {
+		line = downloadline(d);
+		g_string_append_printf(l, "\t%s", line);
+		g_free(line);
+	}
+	return g_string_free(l, FALSE);
+}
+
+/* one tab separated entry per pool: host:port or address:port, open,
+ * idle and queued connections, requests started */
+char *
+listpools(void) {
+	gpointer k, v;
+	GHashTableIter it;
+	GString *l;
+	Pool *p;
+
+	l = g_string_new("ok");
+	g_hash_table_iter_init(&it, pools);
+	while(g_hash_table_iter_next(&it, &k, &v)) {
+		p = v;
+		g_string_append_printf(l, "\t%s %d %d %d %u", (char *)k, p->open,
+				p->open - p->busy, p->queued, p->requests);
+	}
+	return g_string_free(l, FALSE);
+}
+
+/* maps the blocklist index shared by all processes, it is rebuilt
+ * first when the blocklist is newer */
+void
+loadblocklist(void) {
+	int fd;
+	char *idx;
+	struct stat src, st;
+	BlockHeader hdr;
+
+	idx = g_strconcat(blockfile, ".idx", NULL);
+	if(stat(blockfile, &src) < 0 || src.st_size == 0) {
+		g_free(idx);
+		return;
+	}
+	/* indexes of an older format are rebuilt as well */
+	if((fd = open(idx, O_RDONLY)) < 0 || fstat(fd, &st) < 0
+			|| st.st_mtime < src.st_mtime
+			|| read(fd, &hdr, sizeof hdr) != sizeof hdr
+			|| strncmp(hdr.magic, "surfbl2", sizeof hdr.magic)) {
+		if(fd >= 0)
+			close(fd);
+		buildblocklist(blockfile, idx);
+		fd = open(idx, O_RDONLY);
+	}
+	if(fd >= 0 && fstat(fd, &st) == 0
+			&& st.st_size >= sizeof(BlockHeader)
+			&& (blockindex = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+					fd, 0)) == MAP_FAILED)
+		blockindex = NULL;
+	if(fd >= 0)
+		close(fd);
+	g_free(idx);
+	if(!blockindex)
+		return;
+	blocksize = st.st_size;
+	blockhosts = (guint32 *)(blockindex + 1);
+	blockstates = (BlockState *)(blockhosts + blockindex->hashsize);
+	blocktrans = (BlockTrans *)(blockstates + blockindex->nstates);
+	blockpool = (char *)(blocktrans + blockindex->ntrans);
+	if(strcmp(blockindex->magic, "surfbl2") || blockindex->nstates == 0
+			|| !blockindex->hashsize
+			|| blockindex->hashsize & (blockindex->hashsize - 1)
+			|| blockpool + blockindex->poolsize != (char *)blockindex + blocksize) {
+		fputs("surf: invalid blocklist index\n", stderr);
+		munmap(blockindex, blocksize);
+		blockindex = NULL;
+	}
+}
+
 void
 loadcommit(WebKitWebView *view, WebKitWebFrame *f, Client *c) {
-	setatom(c, uriprop, geturi(c));
+	const char *uri;
+	gboolean trusted;
+
+	uri = geturi(c);
+	/* subframe commits keep the uri, spare the X round trip */
+	if(!c->uri || strcmp(uri, c->uri)) {
+		c->uri = copystr(&c->uri, uri);
+		setatom(c, uriprop, uri);
+	}
+	if(f == webkit_web_view_get_main_frame(view))
+		histrecord(uri, NULL);
+	profilemark("commit", profiletime());
+	trusted = g_str_has_prefix(uri, "https://");
+	if(trusted != c->trusted) {
+		c->trusted = trusted;
+		if(c->gc)
+			gdk_gc_set_rgb_fg_color(c->gc, trusted ? &trustcolor : &progresscolor);
+		gtk_widget_queue_draw(c->indicator);
+	}
+	touchsession();
+}
+
+/* returns the user script, read again only when it changed on disk */
+JSStringRef
+loadscript(void) {
+	static JSStringRef jsscript = NULL;
+	static struct stat last;
+	char *script;
+	struct stat st;
+
+	if(stat(scriptfile, &st) < 0)
+		memset(&st, 0, sizeof st);
+	/* an edit within the same second still changes one of these */
+	if(jsscript && st.st_mtime == last.st_mtime
+			&& st.st_mtim.tv_nsec == last.st_mtim.tv_nsec
+			&& st.st_size == last.st_size && st.st_ino == last.st_ino)
+		return jsscript;
+	if(jsscript)
+		JSStringRelease(jsscript);
+	jsscript = NULL;
+	last = st;
+	if(st.st_size > 0 && g_file_get_contents(scriptfile, &script, NULL, NULL)) {
+		jsscript = JSStringCreateWithUTF8CString(script);
+		g_free(script);
+	}
+	return jsscript;
+}
+
+/* maps the site index, rebuilt first when the rules are newer. It is
+ * checked on every navigation, so edits apply without a restart. */
+void
+loadsites(void) {
+	int fd;
+	char *idx;
+	struct stat src, st;
+
+	if(stat(sitefile, &src) < 0 || src.st_size == 0)
+		memset(&src, 0, sizeof src);
+	/* an edit within the same second still changes one of these */
+	if(src.st_mtime == sitestat.st_mtime
+			&& src.st_mtim.tv_nsec == sitestat.st_mtim.tv_nsec
+			&& src.st_size == sitestat.st_size
+			&& src.st_ino == sitestat.st_ino)
+		return;
+	if(siteindex)
+		munmap(siteindex, sitesize);
+	siteindex = NULL;
+	sitestat = src;
+	if(!src.st_size)
+		return;
+	idx = g_strconcat(sitefile, ".idx", NULL);
+	/* only an index strictly newer than the file is known to cover it */
+	if(stat(idx, &st) < 0 || st.st_mtime < src.st_mtime
+			|| (st.st_mtime == src.st_mtime
+				&& st.st_mtim.tv_nsec <= src.st_mtim.tv_nsec))
+		buildsites(sitefile, idx);
+	if((fd = open(idx, O_RDONLY)) >= 0 && fstat(fd, &st) == 0
+			&& st.st_size >= sizeof(SiteHeader)
+			&& (siteindex = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+					fd, 0)) == MAP_FAILED)
+		siteindex = NULL;
+	if(fd >= 0)
+		close(fd);
+	g_free(idx);
+	if(!siteindex)
+		return;
+	sitesize = st.st_size;
+	sitehash = (guint32 *)(siteindex + 1);
+	sitepool = (char *)(sitehash + siteindex->hashsize);
+	if(strcmp(siteindex->magic, "surfst1") || !siteindex->hashsize
+			|| siteindex->hashsize & (siteindex->hashsize - 1)
+			|| sitepool + siteindex->poolsize != (char *)siteindex + sitesize) {
+		fputs("surf: invalid site index\n", stderr);
+		munmap(siteindex, sitesize);
+		siteindex = NULL;
+	}
 }
 
 void
 loadstart(WebKitWebView *view, WebKitWebFrame *f, Client *c) {
 	c->progress = 0;
 	update(c);
-	reloadcookies();
+	synccookies();
 }
 
 void
@@ -438,6 +3079,7 @@ loaduri(Client *c, const Arg *arg) {
 
 	u = g_strrstr(uri, "://") ? g_strdup(uri)
 		: g_strdup_printf("http://%s", uri);
+	restoreclient(c, FALSE);
 	webkit_web_view_load_uri(c->view, u);
 	c->progress = 0;
 	c->title = copystr(&c->title, u);
@@ -445,19 +3087,82 @@ loaduri(Client *c, const Arg *arg) {
 	update(c);
 }
 
+gboolean
+loopcheck(GSource *src) {
+	loopwake = g_timer_elapsed(probeclock, NULL);
+	return dumprequested;
+}
+
+/* appends the statistics to statsfile after a SIGUSR1 */
+gboolean
+loopdispatch(GSource *src, GSourceFunc cb, gpointer d) {
+	FILE *f;
+
+	dumprequested = 0;
+	if(!(f = fopen(statsfile, "a"))) {
+		perror("surf: cannot write stats");
+		return TRUE;
+	}
+	dumpstats(f);
+	fclose(f);
+	return TRUE;
+}
+
+/* called before the main loop polls: the time since the last poll
+ * returned was spent in handlers of one iteration */
+gboolean
+loopprepare(GSource *src, gint *timeout) {
+	gdouble busy;
+
+	*timeout = -1;
+	if(loopwake >= 0 && stalltime > 0) {
+		busy = (g_timer_elapsed(probeclock, NULL) - loopwake) * 1000;
+		if(busy > stalltime) {
+			counts[CountStalls]++;
+			if(slowest >= 0)
+				fprintf(stderr, "surf: stall: %.1f ms, %s took %.1f ms\n",
+						busy, probes[slowest].name, slowesttime);
+			else
+				fprintf(stderr, "surf: stall: %.1f ms outside surf handlers\n",
+						busy);
+		}
+	}
+	loopwake = -1;
+	slowest = -1;
+	slowesttime = 0;
+	return dumprequested;
+}
+
 void
 navigate(Client *c, const Arg *arg) {
 	gint steps = *(gint *)arg;
+
+	restoreclient(c, FALSE);
 	webkit_web_view_go_back_or_forward(c->view, steps);
 }
 
+/* bandwidth cap of a request class, tighter while more important
+ * requests are in flight */
+int
+netcap(int cls) {
+	int i;
+
+	for(i = 0; i < cls; i++)
+		if(netbusy[i])
+			return busycaps[cls];
+	return netcaps[cls];
+}
+
+/* creates a window, a lazy one gets its view when restoreclient() needs
+ * it */
 Client *
-newclient(void) {
+newclient(gboolean lazy) {
 	int i;
 	Client *c;
-	WebKitWebSettings *settings;
 	GdkGeometry hints = { 1, 1 };
-	char *uri, *ua;
+	GtkEntryCompletion *completion;
+	GtkListStore *store;
+	GtkCellRenderer *cell;
 
 	if(!(c = calloc(1, sizeof(Client))))
 		die("Cannot malloc!\n");
@@ -485,6 +3190,11 @@ newclient(void) {
 	g_signal_connect(G_OBJECT(c->win), "destroy", G_CALLBACK(destroywin), c);
 	g_signal_connect(G_OBJECT(c->win), "key-press-event", G_CALLBACK(keypress), c);
 	g_signal_connect(G_OBJECT(c->win), "size-allocate", G_CALLBACK(resize), c);
+	g_signal_connect(G_OBJECT(c->win), "focus-in-event", G_CALLBACK(focusin), c);
+	g_signal_connect(G_OBJECT(c->win), "focus-out-event", G_CALLBACK(focusout), c);
+	g_signal_connect(G_OBJECT(c->win), "map-event", G_CALLBACK(visibility), c);
+	g_signal_connect(G_OBJECT(c->win), "unmap-event", G_CALLBACK(visibility), c);
+	g_signal_connect(G_OBJECT(c->win), "visibility-notify-event", G_CALLBACK(visibility), c);
 
 	if(!(c->items = calloc(1, sizeof(GtkWidget *) * LENGTH(items))))
 		die("Cannot malloc!\n");
@@ -504,19 +3214,23 @@ newclient(void) {
 	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(c->scroll),
 			GTK_POLICY_NEVER, GTK_POLICY_NEVER);
 
-	/* Webview */
-	c->view = WEBKIT_WEB_VIEW(webkit_web_view_new());
-	g_signal_connect(G_OBJECT(c->view), "title-changed", G_CALLBACK(titlechange), c);
-	g_signal_connect(G_OBJECT(c->view), "load-progress-changed", G_CALLBACK(progresschange), c);
-	g_signal_connect(G_OBJECT(c->view), "load-committed", G_CALLBACK(loadcommit), c);
-	g_signal_connect(G_OBJECT(c->view), "load-started", G_CALLBACK(loadstart), c);
-	g_signal_connect(G_OBJECT(c->view), "hovering-over-link", G_CALLBACK(linkhover), c);
-	g_signal_connect(G_OBJECT(c->view), "create-web-view", G_CALLBACK(createwindow), c);
-	g_signal_connect(G_OBJECT(c->view), "new-window-policy-decision-requested", G_CALLBACK(decidewindow), c);
-	g_signal_connect(G_OBJECT(c->view), "mime-type-policy-decision-requested", G_CALLBACK(decidedownload), c);
-	g_signal_connect(G_OBJECT(c->view), "download-requested", G_CALLBACK(initdownload), c);
-	g_signal_connect(G_OBJECT(c->view), "window-object-cleared", G_CALLBACK(windowobjectcleared), c);
-	g_signal_connect(G_OBJECT(c->view), "populate-popup", G_CALLBACK(context), c);
+	/* Prompt */
+	c->prompt = gtk_entry_new();
+	completion = gtk_entry_completion_new();
+	store = gtk_list_store_new(2, G_TYPE_STRING, G_TYPE_STRING);
+	gtk_entry_completion_set_model(completion, GTK_TREE_MODEL(store));
+	g_object_unref(store);
+	gtk_entry_completion_set_text_column(completion, 0);
+	gtk_entry_completion_set_match_func(completion, promptmatch, NULL, NULL);
+	cell = gtk_cell_renderer_text_new();
+	gtk_cell_layout_pack_start(GTK_CELL_LAYOUT(completion), cell, TRUE);
+	gtk_cell_layout_add_attribute(GTK_CELL_LAYOUT(completion), cell, "text", 1);
+	g_signal_connect(G_OBJECT(completion), "match-selected", G_CALLBACK(promptselected), c);
+	/* refill the store before the completion filters it */
+	g_signal_connect(G_OBJECT(c->prompt), "changed", G_CALLBACK(promptchanged), c);
+	g_signal_connect(G_OBJECT(c->prompt), "activate", G_CALLBACK(promptactivate), c);
+	gtk_entry_set_completion(GTK_ENTRY(c->prompt), completion);
+	g_object_unref(completion);
 
 	/* Indicator */
 	c->indicator = gtk_drawing_area_new();
@@ -525,37 +3239,33 @@ newclient(void) {
 			G_CALLBACK (exposeindicator), c);
 
 	/* Arranging */
-	gtk_container_add(GTK_CONTAINER(c->scroll), GTK_WIDGET(c->view));
 	gtk_container_add(GTK_CONTAINER(c->win), c->vbox);
+	gtk_container_add(GTK_CONTAINER(c->vbox), c->prompt);
 	gtk_container_add(GTK_CONTAINER(c->vbox), c->scroll);
 	gtk_container_add(GTK_CONTAINER(c->vbox), c->indicator);
 
 	/* Setup */
+	gtk_box_set_child_packing(GTK_BOX(c->vbox), c->prompt, FALSE, FALSE, 0, GTK_PACK_START);
 	gtk_box_set_child_packing(GTK_BOX(c->vbox), c->indicator, FALSE, FALSE, 0, GTK_PACK_START);
 	gtk_box_set_child_packing(GTK_BOX(c->vbox), c->scroll, TRUE, TRUE, 0, GTK_PACK_START);
-	gtk_widget_grab_focus(GTK_WIDGET(c->view));
+	if(lazy)
+		c->lazy = TRUE;
+	else
+		newview(c);
 	gtk_widget_show(c->vbox);
 	gtk_widget_show(c->indicator);
 	gtk_widget_show(c->scroll);
-	gtk_widget_show(GTK_WIDGET(c->view));
 	gtk_widget_show(c->win);
 	gtk_window_set_geometry_hints(GTK_WINDOW(c->win), NULL, &hints, GDK_HINT_MIN_SIZE);
 	gdk_window_set_events(GTK_WIDGET(c->win)->window, GDK_ALL_EVENTS_MASK);
 	gdk_window_add_filter(GTK_WIDGET(c->win)->window, processx, c);
-	webkit_web_view_set_full_content_zoom(c->view, TRUE);
-	settings = webkit_web_view_get_settings(c->view);
-	if(!(ua = getenv("SURF_USERAGENT")))
-		ua = useragent;
-	g_object_set(G_OBJECT(settings), "user-agent", ua, NULL);
-	uri = g_strconcat("file://", stylefile, NULL);
-	g_object_set(G_OBJECT(settings), "user-stylesheet-uri", uri, NULL);
-	g_free(uri);
 	setatom(c, findprop, "");
 
-	c->download = NULL;
 	c->title = NULL;
+	c->idle = time(NULL);
 	c->next = clients;
 	clients = c;
+	setcachemodel();
 	if(showxid) {
 		gdk_display_sync(gtk_widget_get_display(c->win));
 		printf("%u\n", (guint)GDK_WINDOW_XID(GTK_WIDGET(c->win)->window));
@@ -564,13 +3274,68 @@ newclient(void) {
 	return c;
 }
 
+void
+newview(Client *c) {
+	WebKitWebSettings *settings;
+	char *uri, *ua;
+
+	c->view = WEBKIT_WEB_VIEW(webkit_web_view_new());
+	c->site = copystr(&c->site, NULL);
+	g_signal_connect(G_OBJECT(c->view), "title-changed", G_CALLBACK(titlechange), c);
+	g_signal_connect(G_OBJECT(c->view), "button-press-event", G_CALLBACK(buttonpress), c);
+	g_signal_connect(G_OBJECT(c->view), "load-progress-changed", G_CALLBACK(progresschange), c);
+	g_signal_connect(G_OBJECT(c->view), "load-committed", G_CALLBACK(loadcommit), c);
+	g_signal_connect(G_OBJECT(c->view), "load-started", G_CALLBACK(loadstart), c);
+	g_signal_connect(G_OBJECT(c->view), "hovering-over-link", G_CALLBACK(linkhover), c);
+	g_signal_connect(G_OBJECT(c->view), "create-web-view", G_CALLBACK(createwindow), c);
+	g_signal_connect(G_OBJECT(c->view), "navigation-policy-decision-requested", G_CALLBACK(decidenavigation), c);
+	g_signal_connect(G_OBJECT(c->view), "new-window-policy-decision-requested", G_CALLBACK(decidewindow), c);
+	g_signal_connect(G_OBJECT(c->view), "mime-type-policy-decision-requested", G_CALLBACK(decidedownload), c);
+	g_signal_connect(G_OBJECT(c->view), "download-requested", G_CALLBACK(initdownload), c);
+	g_signal_connect(G_OBJECT(c->view), "window-object-cleared", G_CALLBACK(windowobjectcleared), c);
+	g_signal_connect(G_OBJECT(c->view), "populate-popup", G_CALLBACK(context), c);
+	g_signal_connect(G_OBJECT(c->view), "resource-request-starting", G_CALLBACK(resourcestart), c);
+
+	gtk_container_add(GTK_CONTAINER(c->scroll), GTK_WIDGET(c->view));
+	gtk_widget_grab_focus(GTK_WIDGET(c->view));
+	gtk_widget_show(GTK_WIDGET(c->view));
+	webkit_web_view_set_full_content_zoom(c->view, TRUE);
+	settings = webkit_web_view_get_settings(c->view);
+	if(!(ua = getenv("SURF_USERAGENT")))
+		ua = useragent;
+	g_object_set(G_OBJECT(settings), "user-agent", ua, NULL);
+	uri = g_strconcat("file://", stylefile, NULL);
+	g_object_set(G_OBJECT(settings), "user-stylesheet-uri", uri, NULL);
+	g_free(uri);
+}
+
 void
 newwindow(Client *c, const Arg *arg) {
 	guint i = 0;
 	const char *cmd[7], *uri;
-	const Arg a = { .v = (void *)cmd };
-	char tmp[64];
+	Arg a = { .v = (void *)cmd };
+	char tmp[64], *msg;
+	ssize_t n;
 
+	uri = arg->v ? (char *)arg->v : c->linkhover;
+	if(single) {
+		c = newclient(FALSE);
+		if(uri) {
+			a.v = uri;
+			loaduri(c, &a);
+		}
+		return;
+	}
+	g_idle_add(fillpool, NULL);
+	if(nwarm > 0) {
+		msg = g_strdup_printf("%u %d %s\n", (guint)embed, showxid,
+				uri ? uri : "");
+		n = write(warm[--nwarm], msg, strlen(msg));
+		close(warm[nwarm]);
+		g_free(msg);
+		if(n > 0)
+			return;
+	}
 	cmd[i++] = progname;
 	if(embed) {
 		cmd[i++] = "-e";
@@ -581,13 +3346,105 @@ newwindow(Client *c, const Arg *arg) {
 		cmd[i++] = "-x";
 	}
 	cmd[i++] = "--";
-	uri = arg->v ? (char *)arg->v : c->linkhover;
 	if(uri)
 		cmd[i++] = uri;
 	cmd[i++] = NULL;
 	spawn(NULL, &a);
 }
 
+/* opens and locks the cookie journal, retrying if it got compacted meanwhile */
+int
+opencookies(void) {
+	int fd, tries;
+	struct stat a, b;
+
+	for(tries = 0; tries < 8; tries++) {
+		if((fd = open(cookiefile, O_WRONLY|O_APPEND|O_CREAT, 0600)) < 0)
+			return -1;
+		if(flock(fd, LOCK_EX) < 0) {
+			close(fd);
+			if(errno == EINTR)
+				continue;
+			perror("surf: cannot lock cookies");
+			return -1;
+		}
+		if(fstat(fd, &a) == 0 && stat(cookiefile, &b) == 0
+				&& a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+			return fd;
+		close(fd);
+	}
+	fputs("surf: cookie journal keeps being replaced\n", stderr);
+	return -1;
+}
+
+SoupCookie *
+parsecookie(const char *line) {
+	char **f;
+	SoupCookie *c = NULL;
+	SoupDate *e;
+	gboolean httponly;
+
+	if((httponly = g_str_has_prefix(line, "#HttpOnly_")))
+		line += 10;
+	f = g_strsplit(line, "\t", 7);
+	if(line[0] != '#' && g_strv_length(f) == 7) {
+		c = soup_cookie_new(f[5], f[6], f[0], f[2], -1);
+		soup_cookie_set_secure(c, !strcmp(f[3], "TRUE"));
+		soup_cookie_set_http_only(c, httponly);
+		e = soup_date_new_from_time_t(strtoul(f[4], NULL, 10));
+		soup_cookie_set_expires(c, e);
+		soup_date_free(e);
+	}
+	g_strfreev(f);
+	return c;
+}
+
+/* reads the live cookies of the cookie file, also in a thread at startup
+ * as it only touches the cookie file state */
+gpointer
+parsecookies(gpointer d) {
+	int fd;
+	char *data;
+	GHashTable *live;
+	struct stat st;
+
+	if((fd = open(cookiefile, O_RDONLY)) < 0)
+		return NULL;
+	cookieoff = 0;
+	if(fstat(fd, &st) < 0 || !(data = readcookies(fd, st.st_size))) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	cookieino = st.st_ino;
+	live = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify)soup_cookie_free);
+	cookielines = replaycookies(data, live);
+	g_free(data);
+	cookieparsed = profiletime();
+	return live;
+}
+
+/* waits for newwindow() of the parent to hand this zygote a window */
+char *
+parkzygote(void) {
+	char buf[BUFSIZ], *uri;
+	ssize_t n;
+	GString *msg;
+
+	msg = g_string_new(NULL);
+	while((n = read(zygote, buf, sizeof buf)) > 0)
+		g_string_append_len(msg, buf, n);
+	close(zygote);
+	if(!msg->len)
+		exit(EXIT_SUCCESS);
+	embed = strtoul(msg->str, &uri, 10);
+	showxid = strtol(uri, &uri, 10);
+	uri = g_strdup(g_strstrip(uri));
+	g_string_free(msg, TRUE);
+	return uri;
+}
+
 void
 pasteuri(GtkClipboard *clipboard, const char *text, gpointer d) {
 	Arg arg = {.v = text };
@@ -595,73 +3452,713 @@ pasteuri(GtkClipboard *clipboard, const char *text, gpointer d) {
 		loaduri((Client *) d, &arg);
 }
 
+/* forgets a connection once libsoup drops its socket, also on the
+ * message using it so a later socket at that address is not taken
+ * for it */
+void
+poolclosed(gpointer d, GObject *sock) {
+	Conn *cn = d;
+
+	if(cn->msg)
+		connidle(cn->msg);
+	cn->pool->open--;
+	poolrelease(cn->pool);
+	g_hash_table_remove(sockets, sock);
+}
+
+void
+poolfree(gpointer d) {
+	g_free(((Pool *)d)->key);
+	g_free(d);
+}
+
+void
+poolrelease(Pool *p) {
+	if(!--p->refs)
+		g_hash_table_remove(pools, p->key);
+}
+
 void
 print(Client *c, const Arg *arg) {
 	webkit_web_frame_print(webkit_web_view_get_main_frame(c->view));
 }
 
+/* adds a latency of ms to the histogram of p */
+void
+probeadd(int p, gdouble ms) {
+	int i;
+
+	for(i = 0; i < LENGTH(probelimits) && ms >= probelimits[i]; i++);
+	probes[p].hist[i]++;
+	probes[p].n++;
+	probes[p].total += ms;
+	if(ms > probes[p].max)
+		probes[p].max = ms;
+}
+
+void
+probebegin(int p) {
+	probes[p].start = g_timer_elapsed(probeclock, NULL);
+}
+
+/* records the latency of handler p, the slowest one of a main loop
+ * iteration is blamed for a stall */
+void
+probeend(int p) {
+	gdouble ms;
+
+	ms = (g_timer_elapsed(probeclock, NULL) - probes[p].start) * 1000;
+	probeadd(p, ms);
+	if(ms > slowesttime) {
+		slowest = p;
+		slowesttime = ms;
+	}
+}
+
 GdkFilterReturn
 processx(GdkXEvent *e, GdkEvent *event, gpointer d) {
 	Client *c = (Client *)d;
 	XPropertyEvent *ev;
 	Arg arg;
+	GdkFilterReturn r = GDK_FILTER_CONTINUE;
 
 	if(((XEvent *)e)->type == PropertyNotify) {
 		ev = &((XEvent *)e)->xproperty;
 		if(ignorexprop)
 			ignorexprop--;
 		else if(ev->state == PropertyNewValue) {
+			probebegin(ProbeX);
 			if(ev->atom == uriprop) {
 				arg.v = getatom(c, uriprop);
+				c->prompted = probes[ProbeX].start;
 				loaduri(c, &arg);
 			}
-			else if(ev->atom == findprop) {
-				arg.b = TRUE;
-				find(c, &arg);
+			else if(ev->atom == findprop) {
+				c->needle = copystr(&c->needle, getatom(c, findprop));
+				arg.b = TRUE;
+				find(c, &arg);
+			}
+			probeend(ProbeX);
+			r = GDK_FILTER_REMOVE;
+		}
+	}
+	return r;
+}
+
+/* returns when process pid started in clock ticks after boot, 0 if that
+ * is unknown */
+guint64
+procstart(int pid) {
+	int i;
+	char *path, *data, *p;
+	guint64 t = 0;
+
+	path = g_strdup_printf("/proc/%d/stat", pid);
+	if(g_file_get_contents(path, &data, NULL, NULL)) {
+		/* starttime is the 22nd field, the 2nd may contain spaces */
+		for(i = 3, p = strrchr(data, ')'); p && i <= 22; i++)
+			p = strchr(p + 1, ' ');
+		if(p)
+			t = g_ascii_strtoull(p + 1, NULL, 10);
+		g_free(data);
+	}
+	g_free(path);
+	return t;
+}
+
+/* notes the first time phase name of the startup was reached */
+void
+profilemark(const char *name, gdouble ms) {
+	int i;
+
+	if(!profile || nphases == LENGTH(phases))
+		return;
+	for(i = 0; i < nphases; i++)
+		if(!strcmp(phases[i].name, name))
+			return;
+	phases[nphases].name = name;
+	phases[nphases++].ms = ms;
+}
+
+/* prints the startup phases in milliseconds since main() and since the
+ * previous phase, then quits */
+void
+profilereport(void) {
+	int i, j;
+	Phase p;
+
+	if(!profile)
+		return;
+	for(i = 1; i < nphases; i++)
+		for(j = i; j > 0 && phases[j].ms < phases[j - 1].ms; j--) {
+			p = phases[j];
+			phases[j] = phases[j - 1];
+			phases[j - 1] = p;
+		}
+	puts("# phase\tms\tdelta");
+	for(i = 0; i < nphases; i++)
+		printf("%s\t%.3f\t%.3f\n", phases[i].name, phases[i].ms,
+				phases[i].ms - (i ? phases[i - 1].ms : 0));
+	fflush(stdout);
+	profile = FALSE;
+	gtk_main_quit();
+}
+
+gdouble
+profiletime(void) {
+	struct timeval t;
+
+	gettimeofday(&t, NULL);
+	return (t.tv_sec - starttime.tv_sec) * 1000.0
+		+ (t.tv_usec - starttime.tv_usec) / 1000.0;
+}
+
+void
+progresschange(WebKitWebView *v, gint p, Client *c) {
+	GtkScrolledWindow *sw;
+
+	c->progress = p;
+	if(p == 100 && profile) {
+		profilemark("loaded", profiletime());
+		profilereport();
+	}
+	if(p == 100 && c->restorescroll) {
+		c->restorescroll = FALSE;
+		sw = GTK_SCROLLED_WINDOW(c->scroll);
+		gtk_adjustment_set_value(gtk_scrolled_window_get_hadjustment(sw), c->scrollx);
+		gtk_adjustment_set_value(gtk_scrolled_window_get_vadjustment(sw), c->scrolly);
+	}
+	update(c);
+}
+
+/* opens the prompt for a uri or a needle, or dmenu with usedmenu */
+void
+prompt(Client *c, const Arg *arg) {
+	if(usedmenu) {
+		spawn(c, &dmenu[arg->i]);
+		return;
+	}
+	c->promptmode = arg->i;
+	gtk_entry_set_text(GTK_ENTRY(c->prompt), arg->i == PromptUri
+			? (c->uri ? c->uri : "") : (c->needle ? c->needle : ""));
+	gtk_widget_show(c->prompt);
+	gtk_widget_grab_focus(c->prompt);
+	gtk_editable_select_region(GTK_EDITABLE(c->prompt), 0, -1);
+}
+
+/* enter counts from its key press */
+void
+promptactivate(GtkEntry *e, Client *c) {
+	promptgo(c, probes[ProbeKeypress].start);
+}
+
+/* offers the best history matches of the typed text */
+void
+promptchanged(GtkEditable *e, Client *c) {
+	int i, n = 0;
+	HistItem *res = NULL;
+	GtkListStore *store;
+	GtkTreeIter it;
+
+	store = GTK_LIST_STORE(gtk_entry_completion_get_model(
+				gtk_entry_get_completion(GTK_ENTRY(e))));
+	gtk_list_store_clear(store);
+	if(c->promptmode != PromptUri || !histfile)
+		return;
+	histmap(FALSE);
+	res = histquery(gtk_entry_get_text(GTK_ENTRY(e)), promptlines, &n);
+	for(i = 0; i < n; i++) {
+		gtk_list_store_append(store, &it);
+		gtk_list_store_set(store, &it, 0, res[i].uri, 1, res[i].title, -1);
+	}
+	histfree(res, n);
+}
+
+/* navigates or searches without leaving the process, the latency from
+ * start to the request is recorded in the prompt probe */
+void
+promptgo(Client *c, gdouble start) {
+	Arg arg;
+
+	restoreclient(c, FALSE);
+	closeprompt(c);
+	c->prompted = start;
+	if(c->promptmode == PromptUri) {
+		arg.v = gtk_entry_get_text(GTK_ENTRY(c->prompt));
+		loaduri(c, &arg);
+	}
+	else {
+		c->needle = copystr(&c->needle,
+				gtk_entry_get_text(GTK_ENTRY(c->prompt)));
+		arg.b = TRUE;
+		find(c, &arg);
+		probeadd(ProbePrompt, (g_timer_elapsed(probeclock, NULL)
+					- c->prompted) * 1000);
+		c->prompted = 0;
+	}
+}
+
+/* the store holds only matches already */
+gboolean
+promptmatch(GtkEntryCompletion *ec, const char *key, GtkTreeIter *it, gpointer d) {
+	return TRUE;
+}
+
+gboolean
+promptselected(GtkEntryCompletion *ec, GtkTreeModel *m, GtkTreeIter *it, Client *c) {
+	char *uri;
+
+	gtk_tree_model_get(m, it, 0, &uri, -1);
+	gtk_entry_set_text(GTK_ENTRY(c->prompt), uri);
+	g_free(uri);
+	/* picked with the mouse, the last keypress is no start */
+	promptgo(c, g_timer_elapsed(probeclock, NULL));
+	return TRUE;
+}
+
+/* answers each command line of a control connection with one line */
+gboolean
+readcontrol(GIOChannel *ch, GIOCondition cond, gpointer d) {
+	char *cmd, *reply;
+	GIOStatus st;
+
+	while((st = g_io_channel_read_line(ch, &cmd, NULL, NULL, NULL)) == G_IO_STATUS_NORMAL) {
+		reply = control(g_strchomp(cmd));
+		g_io_channel_write_chars(ch, reply, -1, NULL, NULL);
+		g_io_channel_write_chars(ch, "\n", 1, NULL, NULL);
+		g_free(reply);
+		g_free(cmd);
+	}
+	g_io_channel_flush(ch, NULL);
+	return st == G_IO_STATUS_AGAIN;
+}
+
+/* reads the complete journal lines past cookieoff and advances it */
+char *
+readcookies(int fd, off_t size) {
+	char *data, *end;
+	ssize_t n;
+
+	data = g_malloc(size - cookieoff + 1);
+	if((n = pread(fd, data, size - cookieoff, cookieoff)) >= 0) {
+		data[n] = '\0';
+		end = strrchr(data, '\n');
+		end = end ? end + 1 : data;
+		*end = '\0';
+		cookieoff += end - data;
+		return data;
+	}
+	g_free(data);
+	return NULL;
+}
+
+/* understands PSI files like /proc/pressure/memory, where the avg10 stall
+ * share is compared to pressurelimit, and cgroup memory.events files,
+ * where any new high, max or oom event counts */
+gboolean
+readpressure(void) {
+	char *data, *p;
+	long events = 0;
+	gboolean pressure = FALSE;
+
+	if(!g_file_get_contents(pressurepath, &data, NULL, NULL))
+		return FALSE;
+	if((p = strstr(data, "some avg10=")))
+		pressure = g_ascii_strtod(p + 11, NULL) > pressurelimit;
+	else {
+		for(p = data; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL)
+			if(g_str_has_prefix(p, "high ") || g_str_has_prefix(p, "max ")
+					|| g_str_has_prefix(p, "oom "))
+				events += strtol(strchr(p, ' '), NULL, 10);
+		pressure = pressureevents >= 0 && events > pressureevents;
+		pressureevents = events;
+	}
+	g_free(data);
+	return pressure;
+}
+
+/* hands out the next tenth of a second worth of bandwidth */
+gboolean
+refill(gpointer d) {
+	int i, cap;
+	gboolean paused = FALSE;
+	GSList *l;
+
+	for(i = 0; i < NetLast; i++) {
+		cap = netcap(i);
+		nettokens[i] = MIN(nettokens[i] + cap / 10, cap / 10);
+		if(!cap || nettokens[i] > 0) {
+			for(l = netpaused[i]; l; l = l->next)
+				soup_session_unpause_message(session, l->data);
+			g_slist_free(netpaused[i]);
+			netpaused[i] = NULL;
+		}
+		paused |= netpaused[i] != NULL;
+	}
+	if(!paused)
+		nettimer = 0;
+	return paused;
+}
+
+void
+reload(Client *c, const Arg *arg) {
+	gboolean nocache = *(gboolean *)arg;
+
+	if(!c->view) {
+		restoreclient(c, TRUE);
+		return;
+	}
+	if(nocache)
+		 webkit_web_view_reload_bypass_cache(c->view);
+	else
+		 webkit_web_view_reload(c->view);
+}
+
+void
+reloadcookies(void) {
+	GHashTable *live;
+
+	probebegin(ProbeReload);
+	if((live = parsecookies(NULL)))
+		installcookies(live);
+	probeend(ProbeReload);
+}
+
+/* hands uri over to a running surf, returns FALSE if there is none */
+gboolean
+remotewindow(const char *uri) {
+	int fd;
+	ssize_t n = 0;
+	char *msg, xid[64];
+	struct sockaddr_un addr;
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return FALSE;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketfile, LENGTH(addr.sun_path) - 1);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+		msg = g_strconcat("open ", uri ? uri : "", "\n", NULL);
+		if(write(fd, msg, strlen(msg)) > 0
+				&& (n = read(fd, xid, LENGTH(xid) - 1)) > 3 && showxid) {
+			xid[n] = '\0';
+			fputs(xid + 3, stdout);
+		}
+		g_free(msg);
+	}
+	close(fd);
+	return n > 0;
+}
+
+/* replays the cookie journal in data into live, keyed by domain, path and
+ * name. Later entries win, expired ones delete. Returns the entry count. */
+int
+replaycookies(char *data, GHashTable *live) {
+	char *l, *next, *key;
+	int n = 0;
+	SoupCookie *c;
+
+	for(l = data; l && *l; l = next) {
+		if((next = strchr(l, '\n')))
+			*next++ = '\0';
+		if(!(c = parsecookie(l)))
+			continue;
+		n++;
+		key = g_strconcat(c->domain, "\t", c->path, "\t", c->name, NULL);
+		if(soup_date_is_past(c->expires)) {
+			g_hash_table_remove(live, key);
+			g_free(key);
+			soup_cookie_free(c);
+		}
+		else
+			g_hash_table_replace(live, key, c);
+	}
+	return n;
+}
+
+void
+resolved(SoupAddress *a, guint status, gpointer d) {
+	g_object_unref(a);
+}
+
+/* remembers main frame documents so requestqueued() can tell them apart */
+void
+resourcestart(WebKitWebView *v, WebKitWebFrame *f, WebKitWebResource *r, WebKitNetworkRequest *req, WebKitNetworkResponse *res, Client *c) {
+	const char *uri;
+	gboolean block;
+
+	uri = webkit_network_request_get_uri(req);
+	if(c->prompted && f == webkit_web_view_get_main_frame(v)) {
+		probeadd(ProbePrompt, (g_timer_elapsed(probeclock, NULL)
+					- c->prompted) * 1000);
+		c->prompted = 0;
+	}
+	if(!g_str_has_prefix(uri, "http://") && !g_str_has_prefix(uri, "https://"))
+		return;
+	/* everything but the document the user navigates to may be blocked */
+	if(blockindex && (f != webkit_web_view_get_main_frame(v)
+			|| webkit_web_frame_get_load_status(f) != WEBKIT_LOAD_PROVISIONAL)) {
+		probebegin(ProbeBlock);
+		block = blocked(uri);
+		probeend(ProbeBlock);
+		if(block) {
+			counts[CountBlocked]++;
+			webkit_network_request_set_uri(req, "about:blank");
+			return;
+		}
+	}
+	if(webkit_web_frame_get_load_status(f) == WEBKIT_LOAD_PROVISIONAL
+			&& f == webkit_web_view_get_main_frame(v))
+		g_hash_table_insert(documents, g_strdup(uri), NULL);
+}
+
+/* recreates the view of a discarded window and reloads its page unless
+ * the caller is about to navigate anyway */
+void
+restoreclient(Client *c, gboolean load) {
+	int i;
+	WebKitWebBackForwardList *l;
+
+	if(c->view)
+		return;
+	newview(c);
+	c->lazy = FALSE;
+	if(!c->nhist)
+		return;
+	l = webkit_web_view_get_back_forward_list(c->view);
+	for(i = 0; i < c->nhist; i++)
+		webkit_web_back_forward_list_add_item(l, c->hist[i]);
+	c->curhist = CLAMP(c->curhist, 0, c->nhist - 1);
+	webkit_web_back_forward_list_go_to_item(l, c->hist[c->curhist]);
+	webkit_web_view_set_zoom_level(c->view, c->zoomlevel);
+	if(load) {
+		c->restorescroll = TRUE;
+		webkit_web_view_go_to_back_forward_item(c->view, c->hist[c->curhist]);
+	}
+	for(i = 0; i < c->nhist; i++)
+		g_object_unref(c->hist[i]);
+	g_free(c->hist);
+	c->hist = NULL;
+	c->nhist = 0;
+}
+
+/* recreates the windows of session files left by surf processes which are
+ * gone. A live process with the pid of a file only owns it if it started
+ * when the file says. The windows load when focused or restorejobs at a
+ * time in the background. */
+void
+restoresession(void) {
+	int i, pid;
+	char *path, *data, **lines, **f;
+	const char *name;
+	Client *c;
+	GDir *dir;
+	guint64 start;
+
+	if(!(dir = g_dir_open(sessiondir, 0, NULL)))
+		return;
+	while((name = g_dir_read_name(dir))) {
+		pid = atoi(name);
+		if(pid <= 0 || strchr(name, '.'))
+			continue;
+		path = g_strconcat(sessiondir, name, NULL);
+		if(!g_file_get_contents(path, &data, NULL, NULL)) {
+			g_free(path);
+			continue;
+		}
+		lines = g_strsplit(data, "\n", -1);
+		g_free(data);
+		if((!kill(pid, 0) || errno == EPERM)
+				&& (!g_str_has_prefix(lines[0], "process\t")
+					|| !(start = procstart(pid))
+					|| start == g_ascii_strtoull(lines[0] + 8, NULL, 10))) {
+			g_strfreev(lines);
+			g_free(path);
+			continue;
+		}
+		for(i = 0, c = NULL; lines[i]; i++) {
+			f = g_strsplit(lines[i], "\t", 0);
+			if(!strcmp(f[0], "window") && g_strv_length(f) == 6) {
+				c = newclient(TRUE);
+				c->curhist = atoi(f[1]);
+				c->zoomlevel = g_ascii_strtod(f[2], NULL);
+				c->zoomed = atoi(f[3]);
+				c->scrollx = atoi(f[4]);
+				c->scrolly = atoi(f[5]);
+			}
+			else if(c && !strcmp(f[0], "item") && g_strv_length(f) == 3) {
+				c->hist = g_renew(WebKitWebHistoryItem *, c->hist, c->nhist + 1);
+				c->hist[c->nhist] = webkit_web_history_item_new_with_data(f[1], f[2]);
+				if(c->nhist++ == c->curhist) {
+					c->uri = copystr(&c->uri, f[1]);
+					c->title = copystr(&c->title, f[2]);
+					update(c);
+				}
+			}
+			g_strfreev(f);
+		}
+		g_strfreev(lines);
+		/* deleted once savesession() has written their windows */
+		if(sessionpath)
+			restored = g_slist_prepend(restored, path);
+		else {
+			unlink(path);
+			g_free(path);
+		}
+	}
+	g_dir_close(dir);
+	if(restorejobs > 0 && !trickler)
+		trickler = g_timeout_add(500, trickle, NULL);
+	touchsession();
+}
+
+/* picks up the segments of an interrupted download of the same uri, the
+ * saved validator makes the server refuse ranges of a changed file */
+gboolean
+resumedownload(Download *d, const char *file) {
+	int i, n;
+	char *state, *data, **l;
+	gboolean r = FALSE;
+
+	state = g_strconcat(file, ".state", NULL);
+	if(g_file_get_contents(state, &data, NULL, NULL)) {
+		l = g_strsplit(data, "\n", -1);
+		if(g_strv_length(l) > 3 && !strcmp(l[0], d->uri)) {
+			d->total = g_ascii_strtoll(l[1], NULL, 10);
+			if(*l[2])
+				d->validator = g_strdup(l[2]);
+			n = g_strv_length(l) - 3;
+			d->seg = g_new0(Segment, MAX(n, segments));
+			for(i = 0; i < n; i++) {
+				if(sscanf(l[i + 3], "%"G_GINT64_FORMAT" %"G_GINT64_FORMAT" %"G_GINT64_FORMAT,
+						&d->seg[d->nseg].start, &d->seg[d->nseg].pos,
+						&d->seg[d->nseg].end) == 3)
+					d->seg[d->nseg++].d = d;
+			}
+			if(!(d->ranges = r = d->nseg > 0)) {
+				g_free(d->seg);
+				d->seg = NULL;
 			}
-			return GDK_FILTER_REMOVE;
 		}
+		g_strfreev(l);
+		g_free(data);
 	}
-	return GDK_FILTER_CONTINUE;
+	g_free(state);
+	return r;
 }
 
 void
-progresschange(WebKitWebView *v, gint p, Client *c) {
-	c->progress = p;
-	update(c);
+requestqueued(SoupSession *s, SoupMessage *msg, gpointer d) {
+	int cls;
+	char *uri;
+	const char *cc, *pragma;
+	CacheItem *it;
+
+	if(!(cls = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(msg), "class")))) {
+		uri = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+		cls = 1 + (g_hash_table_remove(documents, uri) ? NetDocument : NetSubresource);
+		g_free(uri);
+		g_object_set_data(G_OBJECT(msg), "class", GINT_TO_POINTER(cls));
+	}
+	netbusy[cls - 1]++;
+	g_signal_connect(msg, "got-chunk", G_CALLBACK(throttle), NULL);
+	getpool(msg)->queued++;
+	g_object_set_data(G_OBJECT(msg), "waiting", GINT_TO_POINTER(1));
+	profilemark("request", profiletime());
+	/* the cookies are in the jar before they are sent */
+	waitcookies();
+	if(cls - 1 != NetSubresource || cachesize <= 0 || strcmp(msg->method, "GET"))
+		return;
+	/* fresh subresources are answered from memory unless a reload asks
+	 * for max-age=0 or no-cache */
+	uri = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+	cc = soup_message_headers_get(msg->request_headers, "Cache-Control");
+	pragma = soup_message_headers_get(msg->request_headers, "Pragma");
+	if(!(cc && (strstr(cc, "no-cache") || strstr(cc, "max-age=0")))
+			&& !(pragma && strstr(pragma, "no-cache"))
+			&& (it = g_hash_table_lookup(cachemem, uri))
+			&& it->expires > time(NULL)) {
+		counts[CountCacheHits]++;
+		g_object_set_data(G_OBJECT(msg), "cachehit", GINT_TO_POINTER(1));
+		/* before the session's own idle sends it */
+		g_idle_add_full(G_PRIORITY_HIGH, cacheserve, g_object_ref(msg), NULL);
+	}
+	else {
+		counts[CountCacheMisses]++;
+		g_signal_connect(msg, "got-headers", G_CALLBACK(cacheheaders), NULL);
+	}
+	g_free(uri);
 }
 
+/* a queued message got a connection: sock is counted as open for its
+ * lifetime in the pool of the address it is connected to, a proxy's
+ * for proxied requests, and busy until the message is done */
 void
-reload(Client *c, const Arg *arg) {
-	gboolean nocache = *(gboolean *)arg;
-	if(nocache)
-		 webkit_web_view_reload_bypass_cache(c->view);
-	else
-		 webkit_web_view_reload(c->view);
+requeststarted(SoupSession *s, SoupMessage *msg, SoupSocket *sock, gpointer d) {
+	Pool *p;
+	Conn *cn;
+	SoupAddress *a;
+
+	p = getpool(msg);
+	p->requests++;
+	if(g_object_get_data(G_OBJECT(msg), "waiting")) {
+		p->queued--;
+		g_object_set_data(G_OBJECT(msg), "waiting", NULL);
+	}
+	if((cn = g_hash_table_lookup(sockets, sock)) && cn->msg == msg)
+		return;
+	/* a requeued message may move to another connection */
+	connidle(msg);
+	if(!cn) {
+		cn = g_new0(Conn, 1);
+		if((a = soup_socket_get_remote_address(sock))
+				&& soup_address_get_physical(a))
+			cn->pool = findpool(soup_address_get_physical(a),
+					soup_address_get_port(a));
+		else
+			cn->pool = findpool(soup_message_get_uri(msg)->host,
+					soup_message_get_uri(msg)->port);
+		cn->pool->open++;
+		g_hash_table_insert(sockets, sock, cn);
+		g_object_weak_ref(G_OBJECT(sock), poolclosed, cn);
+	}
+	else if(cn->msg)
+		connidle(cn->msg);
+	cn->msg = msg;
+	cn->pool->busy++;
+	g_object_set_data(G_OBJECT(msg), "conn", cn);
 }
 
 void
-reloadcookies() {
-	SoupCookieJar *jar;
-	GSList *l, *e;
+requestunqueued(SoupSession *s, SoupMessage *msg, gpointer d) {
+	int cls;
+	GByteArray *body;
+	Pool *p;
 
-	lockcookie = TRUE;
-	for(l = e = soup_cookie_jar_all_cookies(cookies); e; e = e->next)
-		soup_cookie_jar_delete_cookie(cookies, (SoupCookie *)e->data);
-	soup_cookies_free(l);
-	jar = soup_cookie_jar_text_new(cookiefile, TRUE);
-	for(l = e = soup_cookie_jar_all_cookies(jar); e; e = e->next)
-		soup_cookie_jar_add_cookie(cookies, (SoupCookie *)e->data);
-	g_slist_free(l);
-	lockcookie = FALSE;
-	g_object_unref(jar);
+	connidle(msg);
+	if((p = g_object_get_data(G_OBJECT(msg), "pool"))) {
+		if(g_object_get_data(G_OBJECT(msg), "waiting"))
+			p->queued--;
+		g_object_set_data(G_OBJECT(msg), "waiting", NULL);
+		g_object_set_data(G_OBJECT(msg), "pool", NULL);
+		poolrelease(p);
+	}
+	g_object_set_data(G_OBJECT(msg), "cachehit", NULL);
+	if((cls = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(msg), "class")) - 1) < 0)
+		return;
+	netbusy[cls]--;
+	netpaused[cls] = g_slist_remove(netpaused[cls], msg);
+	if((body = g_object_get_data(G_OBJECT(msg), "cache"))) {
+		cachestore(msg, body);
+		g_object_set_data(G_OBJECT(msg), "cache", NULL);
+	}
 }
 
 void
 resize(GtkWidget *w, GtkAllocation *a, Client *c) {
 	double zoom;
 
-	if(c->zoomed)
+	if(c->zoomed || !c->view)
 		return;
 	zoom = webkit_web_view_get_zoom_level(c->view);
 	if(a->width * a->height < 300 * 400 && zoom != 0.2)
@@ -670,6 +4167,92 @@ resize(GtkWidget *w, GtkAllocation *a, Client *c) {
 		webkit_web_view_set_zoom_level(c->view, 1.0);
 }
 
+/* stores uri, size, validator and segment offsets next to the partial
+ * file */
+void
+savedownload(Download *d) {
+	int i;
+	char *state;
+	GString *l;
+
+	d->saved = time(NULL);
+	if(!d->ranges)
+		return;
+	l = g_string_new(d->uri);
+	g_string_append_printf(l, "\n%"G_GINT64_FORMAT"\n%s\n", d->total,
+			d->validator ? d->validator : "");
+	for(i = 0; i < d->nseg; i++)
+		g_string_append_printf(l, "%"G_GINT64_FORMAT" %"G_GINT64_FORMAT" %"G_GINT64_FORMAT"\n",
+				d->seg[i].start, d->seg[i].pos, d->seg[i].end);
+	state = g_strconcat(d->file, ".state", NULL);
+	g_file_set_contents(state, l->str, l->len, NULL);
+	g_free(state);
+	g_string_free(l, TRUE);
+}
+
+/* writes uri and title of the back/forward items, zoom and scroll
+ * position of every window to this process' session file */
+gboolean
+savesession(gpointer d) {
+	int i, n, back;
+	char *tmp, *uri, *title, zoom[G_ASCII_DTOSTR_BUF_SIZE];
+	FILE *f;
+	Client *c;
+	WebKitWebBackForwardList *l = NULL;
+	WebKitWebHistoryItem *item;
+	GtkScrolledWindow *sw;
+
+	sessioner = 0;
+	if(!clients) {
+		unlink(sessionpath);
+		droprestored();
+		return FALSE;
+	}
+	tmp = g_strconcat(sessionpath, ".tmp", NULL);
+	if(!(f = fopen(tmp, "w"))) {
+		perror("surf: cannot write session");
+		g_free(tmp);
+		return FALSE;
+	}
+	fprintf(f, "process\t%"G_GUINT64_FORMAT"\n", sessionstart);
+	for(c = clients; c; c = c->next) {
+		if(c->view) {
+			l = webkit_web_view_get_back_forward_list(c->view);
+			if(!webkit_web_back_forward_list_get_current_item(l))
+				continue;
+			c->curhist = back = webkit_web_back_forward_list_get_back_length(l);
+			n = back + 1 + webkit_web_back_forward_list_get_forward_length(l);
+			c->zoomlevel = webkit_web_view_get_zoom_level(c->view);
+			sw = GTK_SCROLLED_WINDOW(c->scroll);
+			c->scrollx = gtk_adjustment_get_value(gtk_scrolled_window_get_hadjustment(sw));
+			c->scrolly = gtk_adjustment_get_value(gtk_scrolled_window_get_vadjustment(sw));
+		}
+		else if(!(n = c->nhist))
+			continue;
+		fprintf(f, "window\t%d\t%s\t%d\t%d\t%d\n", c->curhist,
+				g_ascii_formatd(zoom, sizeof zoom, "%.2f", c->zoomlevel),
+				c->zoomed, (int)c->scrollx, (int)c->scrolly);
+		for(i = 0; i < n; i++) {
+			item = c->view ? webkit_web_back_forward_list_get_nth_item(l,
+					i - c->curhist) : c->hist[i];
+			uri = g_strdup(webkit_web_history_item_get_uri(item));
+			title = g_strdup(webkit_web_history_item_get_title(item));
+			fprintf(f, "item\t%s\t%s\n", g_strdelimit(uri, "\t\n", ' '),
+					title ? g_strdelimit(title, "\t\n", ' ') : "");
+			g_free(uri);
+			g_free(title);
+		}
+	}
+	if(fclose(f) || rename(tmp, sessionpath) < 0) {
+		perror("surf: cannot write session");
+		unlink(tmp);
+	}
+	else
+		droprestored();
+	g_free(tmp);
+	return FALSE;
+}
+
 void
 scroll(Client *c, const Arg *arg) {
 	gdouble v;
@@ -683,8 +4266,26 @@ scroll(Client *c, const Arg *arg) {
 	gtk_adjustment_set_value(a, v);
 }
 
+void
+segmentdone(SoupSession *session, SoupMessage *msg, gpointer d) {
+	Segment *s = (Segment *)d;
+	Download *dl = s->d;
+
+	s->msg = NULL;
+	dl->running--;
+	if(s->end < 0 && SOUP_STATUS_IS_SUCCESSFUL(msg->status_code))
+		s->end = dl->total = s->pos;
+	if(dl->ending)
+		return;
+	if(s->end < 0 || s->pos < s->end)
+		faildownload(dl);
+	else if(!dl->running)
+		enddownload(dl);
+}
+
 void
 setatom(Client *c, Atom a, const char *v) {
+	counts[CountXRoundTrips]++;
 	XSync(dpy, False);
 	ignorexprop++;
 	XChangeProperty(dpy, GDK_WINDOW_XID(GTK_WIDGET(c->win)->window), a,
@@ -692,12 +4293,94 @@ setatom(Client *c, Atom a, const char *v) {
 			strlen(v) + 1);
 }
 
+/* full size caches only pay off for a few windows on a machine with
+ * enough memory, every other process keeps them minimal */
+void
+setcachemodel(void) {
+	int n;
+	long mb;
+	Client *c;
+
+	for(n = 0, c = clients; c; c = c->next, n++);
+	mb = sysconf(_SC_PHYS_PAGES) / 1024 * (sysconf(_SC_PAGESIZE) / 1024);
+	if(n <= cachedwindows && mb >= lowmemory)
+		webkit_set_cache_model(WEBKIT_CACHE_MODEL_WEB_BROWSER);
+	else
+		webkit_set_cache_model(WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER);
+}
+
+/* hidden windows skip indicator drawing and slow down page timers,
+ * hiding also collects the garbage of the page's script heap */
+void
+sethidden(Client *c, gboolean hidden) {
+	if(hidden == c->hidden)
+		return;
+	c->hidden = hidden;
+	if(hidden && hiddengc && c->view)
+		JSGarbageCollect(webkit_web_frame_get_global_context(
+				webkit_web_view_get_main_frame(c->view)));
+}
+
+/* applies site settings, "script=0 images=0 plugins=0 style=file
+ * useragent=...", over the defaults; NULL gives the defaults */
+void
+setsite(Client *c, const char *settings) {
+	char **f, *ua, *style, *uri;
+	gboolean script = TRUE, images = TRUE, plugins = TRUE;
+	int i;
+
+	if(!c->view || (settings == c->site
+			|| (settings && c->site && !strcmp(settings, c->site))))
+		return;
+	c->site = copystr(&c->site, settings);
+	if(!(ua = getenv("SURF_USERAGENT")))
+		ua = useragent;
+	ua = g_strdup(ua);
+	style = g_strdup(stylefile);
+	f = g_strsplit(settings ? settings : "", " ", -1);
+	for(i = 0; f[i]; i++) {
+		if(g_str_has_prefix(f[i], "script="))
+			script = atoi(f[i] + 7);
+		else if(g_str_has_prefix(f[i], "images="))
+			images = atoi(f[i] + 7);
+		else if(g_str_has_prefix(f[i], "plugins="))
+			plugins = atoi(f[i] + 8);
+		else if(g_str_has_prefix(f[i], "style=")) {
+			g_free(style);
+			style = expandpath(f[i] + 6);
+		}
+		else if(g_str_has_prefix(f[i], "useragent=")) {
+			/* the user agent takes the rest of the line */
+			g_free(ua);
+			ua = g_strdup(strstr(settings, "useragent=") + 10);
+			break;
+		}
+	}
+	g_strfreev(f);
+	uri = g_strconcat("file://", style, NULL);
+	g_object_set(G_OBJECT(webkit_web_view_get_settings(c->view)),
+			"enable-scripts", script, "auto-load-images", images,
+			"enable-plugins", plugins, "user-agent", ua,
+			"user-stylesheet-uri", uri, NULL);
+	g_free(uri);
+	g_free(style);
+	g_free(ua);
+}
+
 void
 setup(void) {
+	static const char *poolprops[] = { "max-conns", "max-conns-per-host",
+		"idle-timeout", "timeout" };
+	static const char *poolenv[] = { "SURF_MAXCONNS", "SURF_MAXCONNSPERHOST",
+		"SURF_IDLETIMEOUT", "SURF_TIMEOUT" };
+	int i, n;
 	SoupSession *s;
 	char *proxy;
-	char *new_proxy;
+	char *new_proxy, *p;
 	SoupURI *puri;
+	struct sockaddr_un addr;
+
+	static GSourceFuncs loopfuncs = { loopprepare, loopcheck, loopdispatch, NULL };
 
 	/* clean up any zombies immediately */
 	sigchld(0);
@@ -705,22 +4388,86 @@ setup(void) {
 	if (!g_thread_supported())
 		g_thread_init(NULL);
 
+	/* instrumentation, SIGUSR1 dumps it to statsfile */
+	probeclock = g_timer_new();
+	g_source_attach(g_source_new(&loopfuncs, sizeof(GSource)), NULL);
+	signal(SIGUSR1, sigusr1);
+
+	/* memory governor, started by deferred() */
+	if(!(pressurepath = getenv("SURF_PRESSURE")))
+		pressurepath = pressurefile;
+
 	dpy = GDK_DISPLAY();
 	session = webkit_get_default_session();
 	uriprop = XInternAtom(dpy, "_SURF_URI", False);
 	findprop = XInternAtom(dpy, "_SURF_FIND", False);
+	gdk_color_parse(progress, &progresscolor);
+	gdk_color_parse(progress_trust, &trustcolor);
+
+	/* benchmarks run cold in a scratch profile, cleanup() removes it */
+	if(benchjobs) {
+		benchdir = g_build_filename(g_get_tmp_dir(), "surf-bench.XXXXXX", NULL);
+		if(!mkdtemp(benchdir))
+			die("surf: cannot create bench profile\n");
+		cookiefile = g_strconcat(benchdir, "/cookies.txt", NULL);
+		dldir = g_strconcat(benchdir, "/dl", NULL);
+		scriptfile = g_strconcat(benchdir, "/script.js", NULL);
+		stylefile = g_strconcat(benchdir, "/style.css", NULL);
+		cachedir = g_strconcat(benchdir, "/cache/", NULL);
+		blockfile = g_strconcat(benchdir, "/blocklist", NULL);
+		sitefile = g_strconcat(benchdir, "/sites", NULL);
+		statsfile = g_strconcat(benchdir, "/stats", NULL);
+		cachesize = 0;
+	}
 
-	/* create dirs and files */
-	cookiefile = buildpath(cookiefile);
-	dldir = buildpath(dldir);
-	scriptfile = buildpath(scriptfile);
-	stylefile = buildpath(stylefile);
+	/* paths, deferred() creates the dirs and files */
+	cookiefile = expandpath(cookiefile);
+	dldir = expandpath(dldir);
+	scriptfile = expandpath(scriptfile);
+	stylefile = expandpath(stylefile);
+	cachedir = expandpath(cachedir);
+	blockfile = expandpath(blockfile);
+	loadblocklist();
+	sitefile = expandpath(sitefile);
+	histfile = histfile && !benchjobs ? expandpath(histfile) : NULL;
+	sessiondir = expandpath(sessiondir);
+	if(sessions && !benchjobs) {
+		sessionpath = g_strdup_printf("%s%d", sessiondir, (int)getpid());
+		sessionstart = procstart(getpid());
+	}
+	if(cachesize > 0) {
+		cachemem = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, cachefree);
+		cachepool = g_thread_pool_new(cachework, NULL, 1, FALSE, NULL);
+		cachequeue(CachePreload, NULL, 0);
+	}
+	cachewritten = cachesize; /* prune on the first store */
+	statsfile = expandpath(statsfile);
 
-	/* cookie persistance */
+	/* cookie persistance, the file is parsed while the first window is
+	 * built and waitcookies() installs it before the first request */
 	s = webkit_get_default_session();
 	cookies = soup_cookie_jar_new();
 	soup_session_add_feature(s, SOUP_SESSION_FEATURE(cookies));
 	g_signal_connect(cookies, "changed", G_CALLBACK(changecookie), NULL);
+	if(!(cookiereader = g_thread_create(parsecookies, NULL, TRUE, NULL)))
+		reloadcookies();
+
+	/* request scheduling */
+	documents = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	warmed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_signal_connect(s, "request-queued", G_CALLBACK(requestqueued), NULL);
+	g_signal_connect(s, "request-unqueued", G_CALLBACK(requestunqueued), NULL);
+
+	/* connection pool, 0 keeps the libsoup default */
+	pools = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, poolfree);
+	sockets = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, g_free);
+	g_signal_connect(s, "request-started", G_CALLBACK(requeststarted), NULL);
+	for(i = 0; i < LENGTH(poolprops); i++) {
+		n = (p = getenv(poolenv[i])) ? atoi(p) : poollimits[i];
+		if(n > 0)
+			g_object_set(G_OBJECT(s), poolprops[i], n, NULL);
+	}
 	if((proxy = getenv("http_proxy")) && strcmp(proxy, "")) {
 		new_proxy = g_strrstr(proxy, "http://") ? g_strdup(proxy) :
 			    g_strdup_printf("http://%s", proxy);
@@ -730,7 +4477,45 @@ setup(void) {
 		soup_uri_free(puri);
 		g_free(new_proxy);
 	}
-	reloadcookies();
+
+	warm = g_new(int, zygotes);
+
+	/* control socket; as single instance later invocations hand
+	 * their windows over to this process through it */
+	if(singleinstance && !embed && zygote < 0) {
+		sockpath = socketfile;
+		single = TRUE;
+	}
+	else if(controlsocket) {
+		sockpath = g_strdup_printf("%s.%d", socketfile, (int)getpid());
+	}
+	if(sockpath) {
+		memset(&addr, 0, sizeof addr);
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, sockpath, LENGTH(addr.sun_path) - 1);
+		p = g_path_get_dirname(sockpath);
+		g_mkdir_with_parents(p, 0755);
+		g_free(p);
+		/* only a socket nobody listens on is stale */
+		if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0) {
+			if(connect(sock, (struct sockaddr *)&addr, sizeof addr) < 0
+					&& errno == ECONNREFUSED)
+				unlink(sockpath);
+			close(sock);
+		}
+		if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+				|| fcntl(sock, F_SETFD, FD_CLOEXEC) < 0
+				|| bind(sock, (struct sockaddr *)&addr, sizeof addr) < 0
+				|| listen(sock, 8) < 0) {
+			perror("surf: cannot listen");
+			if(sock >= 0)
+				close(sock);
+			sock = -1;
+			single = FALSE;
+		}
+		else
+			g_io_add_watch(g_io_channel_unix_new(sock), G_IO_IN, acceptcontrol, NULL);
+	}
 }
 
 void
@@ -740,6 +4525,46 @@ sigchld(int unused) {
 	while(0 < waitpid(-1, NULL, WNOHANG));
 }
 
+const char *
+sitelookup(const char *key, gsize len) {
+	guint32 i, mask = siteindex->hashsize - 1;
+	const char *k;
+
+	for(i = blockhash(key, len) & mask; sitehash[i]; i = (i + 1) & mask) {
+		k = sitepool + sitehash[i] - 1;
+		if(!g_ascii_strncasecmp(k, key, len) && !k[len])
+			return k + len + 1;
+	}
+	return NULL;
+}
+
+/* returns the settings of the most specific pattern matching the host
+ * of uri: the host, then *.parent from the longest, then * */
+const char *
+sitesettings(const char *uri) {
+	const char *h, *e, *p, *v;
+	SoupURI *u;
+
+	if(!siteindex || !(u = soup_uri_new(uri)))
+		return NULL;
+	if(!(h = u->host)) {
+		soup_uri_free(u);
+		return NULL;
+	}
+	e = h + strlen(h);
+	if(!(v = sitelookup(h, e - h)))
+		for(p = memchr(h, '.', e - h); p && !v;
+				p = memchr(p + 1, '.', e - p - 1))
+			v = sitelookup(p, e - p);
+	soup_uri_free(u);
+	return v ? v : sitelookup(".", 1);
+}
+
+void
+sigusr1(int unused) {
+	dumprequested = 1;
+}
+
 void
 source(Client *c, const Arg *arg) {
 	Arg a = { .b = FALSE };
@@ -763,25 +4588,385 @@ spawn(Client *c, const Arg *arg) {
 	}
 }
 
+/* warms up the host of a link hovered for hoverdelay ms: a HEAD request
+ * for / of its origin, sent without cookies, leaves a resolved, connected
+ * and handshaken keep-alive connection in the pool, without preconnect
+ * only the name is resolved. The hovered uri itself is never requested.
+ * Each host is warmed at most once per warmtime seconds, blocked links
+ * are not. */
+gboolean
+speculate(gpointer d) {
+	Client *c = (Client *)d;
+	char *key;
+	time_t now;
+	SoupURI *u, *page;
+
+	c->hoverer = 0;
+	if(!c->linkhover || !(u = soup_uri_new(c->linkhover)))
+		return FALSE;
+	if((u->scheme != SOUP_URI_SCHEME_HTTP && u->scheme != SOUP_URI_SCHEME_HTTPS)
+			|| !u->host) {
+		soup_uri_free(u);
+		return FALSE;
+	}
+	now = time(NULL);
+	g_hash_table_foreach_remove(warmed, warmexpired, &now);
+	page = c->uri ? soup_uri_new(c->uri) : NULL;
+	key = g_strdup_printf("%s:%u", u->host, u->port);
+	/* blocked hosts are not even looked up */
+	if(!(page && soup_uri_host_equal(u, page))
+			&& !g_hash_table_lookup(warmed, key)
+			&& !blocked(c->linkhover)) {
+		counts[CountPreconnects]++;
+		if(preconnect) {
+			soup_uri_set_user(u, NULL);
+			soup_uri_set_password(u, NULL);
+			soup_uri_set_path(u, "/");
+			soup_uri_set_query(u, NULL);
+			soup_uri_set_fragment(u, NULL);
+			c->speculation = soup_message_new_from_uri("HEAD", u);
+			soup_message_disable_feature(c->speculation, SOUP_TYPE_COOKIE_JAR);
+			g_object_set_data(G_OBJECT(c->speculation), "class",
+					GINT_TO_POINTER(NetPrefetch + 1));
+			soup_session_queue_message(session, c->speculation, speculated, c);
+		}
+		else {
+			g_hash_table_replace(warmed, key, GUINT_TO_POINTER(now));
+			key = NULL;
+			soup_address_resolve_async(soup_address_new(u->host, u->port),
+					NULL, NULL, resolved, NULL);
+		}
+	}
+	g_free(key);
+	if(page)
+		soup_uri_free(page);
+	soup_uri_free(u);
+	return FALSE;
+}
+
+void
+speculated(SoupSession *s, SoupMessage *msg, gpointer d) {
+	Client *c = (Client *)d;
+	SoupURI *u;
+
+	c->speculation = NULL;
+	if(SOUP_STATUS_IS_TRANSPORT_ERROR(msg->status_code))
+		return;
+	u = soup_message_get_uri(msg);
+	g_hash_table_replace(warmed, g_strdup_printf("%s:%u", u->host, u->port),
+			GUINT_TO_POINTER(time(NULL)));
+}
+
+/* loads every uri of the corpus file in benchjobs windows at a time */
+void
+startbench(const char *corpus) {
+	int i, j;
+	char *data, **l;
+	Client *c;
+
+	if(!g_file_get_contents(corpus, &data, NULL, NULL))
+		die("surf: cannot read benchmark corpus\n");
+	l = g_strsplit(data, "\n", -1);
+	g_free(data);
+	benchuris = g_new0(char *, g_strv_length(l) + 1);
+	for(i = 0; l[i]; i++)
+		if(*g_strstrip(l[i]) && l[i][0] != '#')
+			benchuris[benchn++] = l[i];
+	if(!benchn)
+		die("surf: empty benchmark corpus\n");
+	for(i = 0; i < LENGTH(benchtimes); i++) {
+		benchtimes[i] = g_new(gdouble, benchn);
+		for(j = 0; j < benchn; j++)
+			benchtimes[i][j] = -1;
+	}
+	benchtimer = g_timer_new();
+	for(i = 0; i < benchjobs && i < benchn; i++) {
+		c = newclient(FALSE);
+		g_signal_connect(G_OBJECT(c->view), "notify::load-status", G_CALLBACK(benchstatus), c);
+		benchload(c);
+	}
+}
+
+/* starts queued downloads while less than maxdownloads are running */
+void
+startdownloads(void) {
+	int i, n = 0;
+	char *file, *part, *uri;
+	gboolean resumed;
+	Download *d, *o;
+
+	for(d = downloads; d; d = d->next)
+		if(d->file)
+			n++;
+	for(d = downloads; d && n < maxdownloads; d = d->next) {
+		if(d->file)
+			continue;
+		/* concurrent downloads must not share a file */
+		for(i = 0, resumed = FALSE; ; i++) {
+			file = i ? g_strdup_printf("%s/%s.%d", dldir, d->name, i)
+				: g_strconcat(dldir, "/", d->name, NULL);
+			part = g_strconcat(file, ".part", NULL);
+			for(o = downloads; o && !(o->file && !strcmp(o->file, file)); o = o->next);
+			if(!o && !d->dl && g_file_test(part, G_FILE_TEST_EXISTS))
+				resumed = resumedownload(d, file);
+			if(!o && (resumed || (!g_file_test(file, G_FILE_TEST_EXISTS)
+					&& !g_file_test(part, G_FILE_TEST_EXISTS))))
+				break;
+			g_free(part);
+			g_free(file);
+		}
+		d->file = file;
+		n++;
+		if(d->dl) {
+			uri = g_strconcat("file://", file, NULL);
+			webkit_download_set_destination_uri(d->dl, uri);
+			g_free(uri);
+			webkit_download_start(d->dl);
+		}
+		else if((d->fd = open(part, O_WRONLY|O_CREAT, 0644)) < 0) {
+			perror("surf: cannot open download");
+			d->failed = TRUE;
+		}
+		else {
+			d->timer = g_timer_new();
+			if(!resumed) {
+				d->seg = g_new0(Segment, MAX(segments, 1));
+				d->seg[0].d = d;
+				d->seg[0].end = -1;
+				d->nseg = 1;
+			}
+			for(i = 0; i < d->nseg; i++)
+				if(d->seg[i].end < 0 || d->seg[i].pos < d->seg[i].end)
+					startsegment(&d->seg[i]);
+		}
+		g_free(part);
+		/* enddownload() starts the remaining ones */
+		if(!d->dl && !d->running) {
+			enddownload(d);
+			return;
+		}
+	}
+}
+
+gboolean
+startidle(gpointer d) {
+	startdownloads();
+	return FALSE;
+}
+
+void
+startsegment(Segment *s) {
+	char *ua;
+
+	if(!(s->msg = soup_message_new("GET", s->d->uri))) {
+		s->d->failed = TRUE;
+		return;
+	}
+	if(!(ua = getenv("SURF_USERAGENT")))
+		ua = useragent;
+	soup_message_headers_replace(s->msg->request_headers, "User-Agent", ua);
+	if(s->d->referer)
+		soup_message_headers_replace(s->msg->request_headers, "Referer", s->d->referer);
+	/* offsets count bytes of the entity, not of an encoding of it */
+	soup_message_headers_replace(s->msg->request_headers, "Accept-Encoding", "identity");
+	if(s->d->validator)
+		soup_message_headers_replace(s->msg->request_headers, "If-Range", s->d->validator);
+	soup_message_headers_set_range(s->msg->request_headers, s->pos,
+			s->end >= 0 ? s->end - 1 : -1);
+	soup_message_body_set_accumulate(s->msg->response_body, FALSE);
+	g_object_set_data(G_OBJECT(s->msg), "class", GINT_TO_POINTER(NetDownload + 1));
+	g_signal_connect(s->msg, "got-headers", G_CALLBACK(gotheaders), s);
+	g_signal_connect(s->msg, "got-chunk", G_CALLBACK(gotchunk), s);
+	s->d->running++;
+	soup_session_queue_message(session, s->msg, segmentdone, s);
+}
+
+/* Escape cancels the downloads of a window once its page has loaded */
 void
 stop(Client *c, const Arg *arg) {
-	if(c->download)
-		webkit_download_cancel(c->download);
-	else
+	int i;
+	WebKitLoadStatus s;
+	Download *d, *n;
+
+	s = webkit_web_view_get_load_status(c->view);
+	if(s != WEBKIT_LOAD_FINISHED && s != WEBKIT_LOAD_FAILED) {
 		webkit_web_view_stop_loading(c->view);
-	c->download = NULL;
+		return;
+	}
+	for(d = downloads, i = 0; d; d = n) {
+		n = d->next;
+		if(d->c == c) {
+			canceldownload(d);
+			i++;
+		}
+	}
+	if(i)
+		fprintf(stderr, "surf: cancelled %d download%s\n", i,
+				i > 1 ? "s" : "");
+}
+
+/* applies cookie journal entries other processes appended since the last
+ * sync; falls back to a full reload once the journal got compacted */
+void
+synccookies(void) {
+	int fd;
+	char *data, *l, *next;
+	SoupCookie *c;
+	struct stat st;
+
+	waitcookies();
+	if((fd = open(cookiefile, O_RDONLY)) < 0)
+		return;
+	if(fstat(fd, &st) < 0 || st.st_ino != cookieino || st.st_size < cookieoff) {
+		close(fd);
+		reloadcookies();
+		return;
+	}
+	if(st.st_size == cookieoff || !(data = readcookies(fd, st.st_size))) {
+		close(fd);
+		cookieskips++;
+		return;
+	}
+	close(fd);
+	cookiesyncs++;
+	/* adding an expired cookie deletes it from the jar */
+	lockcookie = TRUE;
+	for(l = data; l && *l; l = next) {
+		if((next = strchr(l, '\n')))
+			*next++ = '\0';
+		if((c = parsecookie(l))) {
+			soup_cookie_jar_add_cookie(cookies, c);
+			cookiestale++;
+		}
+	}
+	lockcookie = FALSE;
+	g_free(data);
+	if(cookiestale > cookiecompact)
+		compactcookies();
+}
+
+/* pauses messages of a class that used up its bandwidth until refill() */
+void
+throttle(SoupMessage *msg, SoupBuffer *chunk, gpointer d) {
+	int cls;
+
+	cls = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(msg), "class")) - 1;
+	if(!netcap(cls) || (nettokens[cls] -= chunk->length) > 0)
+		return;
+	soup_session_pause_message(session, msg);
+	netpaused[cls] = g_slist_prepend(netpaused[cls], msg);
+	if(!nettimer)
+		nettimer = g_timeout_add(100, refill, NULL);
+}
+
+/* wraps setTimeout and setInterval of a frame so they fire at most every
+ * hiddentimer ms while the window is hidden */
+void
+throttletimers(Client *c, JSContextRef js) {
+	static JSClassRef cls = NULL;
+	static JSStringRef script = NULL;
+	static JSStaticValue values[] = {
+		{ "hidden", gethidden, NULL, kJSPropertyAttributeReadOnly },
+		{ NULL, NULL, NULL, 0 },
+	};
+	JSClassDefinition def = kJSClassDefinitionEmpty;
+	JSValueRef f, arg;
+	char *t;
+
+	if(!cls) {
+		def.staticValues = values;
+		cls = JSClassCreate(&def);
+		t = g_strdup_printf("(function(s) {"
+			"var w = window, t = w.setTimeout, i = w.setInterval;"
+			"w.setTimeout = function(f, d) {"
+			"	var a = [].slice.call(arguments);"
+			"	if(s.hidden) a[1] = Math.max(d || 0, %d);"
+			"	return t.apply(w, a);"
+			"};"
+			"w.setInterval = function(f, d) {"
+			"	var a = [].slice.call(arguments, 2), l = 0;"
+			"	return i.call(w, function() {"
+			"		var n = new Date().getTime();"
+			"		if(s.hidden && n - l < %d) return;"
+			"		l = n;"
+			"		if(typeof f == 'function') f.apply(w, a); else w.eval(f);"
+			"	}, d);"
+			"};"
+			"})", hiddentimer, hiddentimer);
+		script = JSStringCreateWithUTF8CString(t);
+		g_free(t);
+	}
+	f = JSEvaluateScript(js, script, NULL, NULL, 0, NULL);
+	arg = JSObjectMake(js, cls, c);
+	if(f && JSValueIsObject(js, f))
+		JSObjectCallAsFunction(js, JSValueToObject(js, f, NULL), NULL, 1, &arg, NULL);
 }
 
 void
 titlechange(WebKitWebView *v, WebKitWebFrame *f, const char *t, Client *c) {
 	c->title = copystr(&c->title, t);
 	update(c);
+	touchsession();
+	/* pages updating their title log only what changed */
+	if(t && c->uri && f == webkit_web_view_get_main_frame(v)
+			&& (g_strcmp0(c->histuri, c->uri)
+				|| g_strcmp0(c->histtitle, t))) {
+		c->histuri = copystr(&c->histuri, c->uri);
+		c->histtitle = copystr(&c->histtitle, t);
+		histrecord(c->uri, t);
+	}
+}
+
+/* saves the session a second after the last change */
+void
+touchsession(void) {
+	if(sessionpath && !sessioner)
+		sessioner = g_timeout_add_seconds(1, savesession, NULL);
 }
 
+/* restores the next lazy window while less than restorejobs load */
+gboolean
+trickle(gpointer d) {
+	int loading = 0;
+	Client *c, *next = NULL;
+
+	for(c = clients; c; c = c->next)
+		if(c->lazy)
+			next = c;
+		else if(c->view && c->uri && c->progress < 100)
+			loading++;
+	if(next && loading < restorejobs)
+		restoreclient(next, TRUE);
+	if(!next)
+		trickler = 0;
+	return next != NULL;
+}
+
+/* coalesces refreshes of title and indicator to at most one per frame */
 void
 update(Client *c) {
+	if(!c->updater)
+		c->updater = g_timeout_add(1000 / 60, updatetitle, c);
+}
+
+void
+updatedownload(WebKitDownload *o, GParamSpec *pspec, Download *d) {
+	switch(webkit_download_get_status(o)) {
+	case WEBKIT_DOWNLOAD_STATUS_CREATED:
+	case WEBKIT_DOWNLOAD_STATUS_STARTED:
+		break;
+	default:
+		enddownload(d);
+	}
+}
+
+gboolean
+updatetitle(gpointer d) {
+	Client *c = (Client *)d;
 	char *t;
 
+	probebegin(ProbeUpdate);
+	c->updater = 0;
 	if(c->progress != 100)
 		t = g_strdup_printf("[%i%%] %s", c->progress, c->title);
 	else if(c->linkhover)
@@ -789,19 +4974,15 @@ update(Client *c) {
 	else
 		t = g_strdup(c->title);
 	drawindicator(c);
-	gtk_window_set_title(GTK_WINDOW(c->win), t);
-	g_free(t);
-}
-
-void
-updatedownload(WebKitDownload *o, GParamSpec *pspec, Client *c) {
-	WebKitDownloadStatus status;
-
-	status = webkit_download_get_status(c->download);
-	if(status == WEBKIT_DOWNLOAD_STATUS_STARTED || status == WEBKIT_DOWNLOAD_STATUS_CREATED) {
-		c->progress = (gint)(webkit_download_get_progress(c->download)*100);
+	if(c->wintitle && t && !strcmp(t, c->wintitle))
+		g_free(t);
+	else {
+		gtk_window_set_title(GTK_WINDOW(c->win), t);
+		g_free(c->wintitle);
+		c->wintitle = t;
 	}
-	update(c);
+	probeend(ProbeUpdate);
+	return FALSE;
 }
 
 void
@@ -813,24 +4994,85 @@ updatewinid(Client *c) {
 void
 usage(void) {
 	fputs("surf - simple browser\n", stderr);
-	die("usage: surf [-e Window] [-x] [uri]\n");
+	die("usage: surf [-e Window] [-Prx] [-b jobs corpus] [-m corpus] [-q query] [-w fd] [uri]\n");
+}
+
+gboolean
+visibility(GtkWidget *w, GdkEvent *e, Client *c) {
+	if(e->type == GDK_MAP && !started) {
+		profilemark("mapped", profiletime());
+		g_idle_add_full(G_PRIORITY_LOW, deferred, NULL, NULL);
+	}
+	sethidden(c, e->type == GDK_UNMAP || (e->type == GDK_VISIBILITY_NOTIFY
+			&& e->visibility.state == GDK_VISIBILITY_FULLY_OBSCURED));
+	return FALSE;
+}
+
+/* joins the startup cookie reader, the first user of the jar waits */
+void
+waitcookies(void) {
+	GHashTable *live;
+
+	if(!cookiereader)
+		return;
+	live = g_thread_join(cookiereader);
+	cookiereader = NULL;
+	if(live)
+		installcookies(live);
+	profilemark("parse cookies", cookieparsed);
+	profilemark("cookies", profiletime());
+}
+
+gboolean
+warmexpired(gpointer k, gpointer v, gpointer now) {
+	return *(time_t *)now - GPOINTER_TO_UINT(v) >= warmtime;
 }
 
 void
 windowobjectcleared(GtkWidget *w, WebKitWebFrame *frame, JSContextRef js, JSObjectRef win, Client *c) {
 	JSStringRef jsscript;
-	char *script;
-	JSValueRef exception = NULL;
-	GError *error;
-	
-	if(g_file_get_contents(scriptfile, &script, NULL, &error)) {
-		jsscript = JSStringCreateWithUTF8CString(script);
-		JSEvaluateScript(js, jsscript, JSContextGetGlobalObject(js), NULL, 0, &exception);
+
+	probebegin(ProbeScript);
+	if(hiddentimer > 0)
+		throttletimers(c, js);
+	if((!scriptmainframe || frame == webkit_web_view_get_main_frame(c->view))
+			&& (jsscript = loadscript())) {
+		counts[CountScripts]++;
+		JSEvaluateScript(js, jsscript, JSContextGetGlobalObject(js), NULL, 0, NULL);
+	}
+	probeend(ProbeScript);
+}
+
+/* rewrites dldir/.status.pid every second while there are downloads, a
+ * line per download as in listdownloads(), and removes it after them */
+gboolean
+writedownloads(gpointer d) {
+	char *path, *line;
+	GString *l;
+	Download *o;
+
+	path = g_strdup_printf("%s/.status.%d", dldir, (int)getpid());
+	if(!downloads || quitting) {
+		unlink(path);
+		g_free(path);
+		dlwriter = 0;
+		return FALSE;
 	}
+	l = g_string_new(NULL);
+	for(o = downloads; o; o = o->next) {
+		line = downloadline(o);
+		g_string_append_printf(l, "%s\n", line);
+		g_free(line);
+	}
+	g_file_set_contents(path, l->str, l->len, NULL);
+	g_string_free(l, TRUE);
+	g_free(path);
+	return TRUE;
 }
 
 void
 zoom(Client *c, const Arg *arg) {
+	touchsession();
 	c->zoomed = TRUE;
 	if(arg->i < 0)		/* zoom out */
 		webkit_web_view_zoom_out(c->view);
@@ -843,10 +5085,12 @@ zoom(Client *c, const Arg *arg) {
 }
 
 int main(int argc, char *argv[]) {
-	int i;
+	int i, n;
 	Arg arg;
+	HistItem *res;
 
-	progname = argv[0];
+	g_strlcpy(progname, argv[0], sizeof progname);
+	gettimeofday(&starttime, NULL);
 	/* command line args */
 	for(i = 1, arg.v = NULL; i < argc && argv[i][0] == '-'; i++) {
 		if(!strcmp(argv[i], "-x"))
@@ -857,6 +5101,27 @@ int main(int argc, char *argv[]) {
 			else
 				usage();
 		}
+		else if(!strcmp(argv[i], "-b")) {
+			if(++i >= argc || (benchjobs = atoi(argv[i])) <= 0)
+				usage();
+			singleinstance = FALSE;
+			zygotes = 0;
+			discardtime = 0;
+		}
+		else if(!strcmp(argv[i], "-m"))
+			blockbenchmode = TRUE;
+		else if(!strcmp(argv[i], "-q"))
+			histquerymode = TRUE;
+		else if(!strcmp(argv[i], "-P"))
+			profile = TRUE;
+		else if(!strcmp(argv[i], "-r"))
+			restore = TRUE;
+		else if(!strcmp(argv[i], "-w")) {
+			if(++i < argc)
+				zygote = atoi(argv[i]);
+			else
+				usage();
+		}
 		else if(!strcmp(argv[i], "--")) {
 			i++;
 			break;
@@ -868,10 +5133,48 @@ int main(int argc, char *argv[]) {
 	}
 	if(i < argc)
 		arg.v = argv[i];
+	if((benchjobs || blockbenchmode || histquerymode) && !arg.v)
+		usage();
+	if(histquerymode) {
+		if(histfile) {
+			histfile = buildpath(histfile);
+			histmap(TRUE);
+			res = histquery(arg.v, histlimit, &n);
+			for(i = 0; i < n; i++)
+				puts(res[i].uri);
+			histfree(res, n);
+		}
+		return EXIT_SUCCESS;
+	}
+	if(blockbenchmode) {
+		blockfile = buildpath(blockfile);
+		loadblocklist();
+		blockbench(arg.v);
+		return EXIT_SUCCESS;
+	}
+	socketfile = expandpath(socketfile);
+	if(singleinstance && !embed && zygote < 0 && !restore) {
+		if(remotewindow(arg.v))
+			return EXIT_SUCCESS;
+	}
 	setup();
-	newclient();
-	if(arg.v)
-		loaduri(clients, &arg);
+	profilemark("setup", profiletime());
+	if(benchjobs)
+		startbench(arg.v);
+	else {
+		if(zygote >= 0 && !*(char *)(arg.v = parkzygote()))
+			arg.v = NULL;
+		if(restore)
+			restoresession();
+		if(!clients || arg.v) {
+			newclient(FALSE);
+			profilemark("window", profiletime());
+			if(arg.v)
+				loaduri(clients, &arg);
+		}
+	}
+	/* in case no window is ever mapped */
+	g_timeout_add_seconds(1, deferred, NULL);
 	gtk_main();
 	cleanup();
 	return EXIT_SUCCESS;
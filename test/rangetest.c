@@ -0,0 +1,249 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * rangetest runs surf against a local libsoup server and checks its
+ * download ranges: a download is split into segments, an interrupted one
+ * resumes from its .state file and a server answering 200 to a range is
+ * fetched in a single stream. It needs a display, xvfb-run will do, and
+ * runs surf with HOME set to a scratch directory, which GLib 2.36 and
+ * later honour.
+ *
+ * usage: rangetest path/to/surf
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <libsoup/soup.h>
+
+#define SIZE  (1024 * 1024)
+#define CHUNK (16 * 1024)
+
+static void check(gboolean ok, const char *what);
+static gboolean dropconn(gpointer d);
+static void dropped(SoupMessage *msg, gpointer d);
+static void fetch(const char *name);
+static void serve(SoupServer *srv, SoupMessage *msg, const char *path,
+		GHashTable *q, SoupClientContext *cl, gpointer d);
+static void settle(int secs);
+static void stopsurf(void);
+static gboolean waitfile(const char *path, int secs);
+
+static char body[SIZE];
+static char *surf, *home, *dldir;
+static guint port;
+static GPid pid = 0;
+static int failures = 0;
+
+/* requests with a Range header, those starting at 0 and broken ones */
+static int ranges, fromzero, drops;
+static gboolean breaking = FALSE;
+
+void
+check(gboolean ok, const char *what) {
+	printf("%s\t%s\n", ok ? "ok" : "FAIL", what);
+	if(!ok)
+		failures++;
+}
+
+/* closes the connection of a range answered in part */
+gboolean
+dropconn(gpointer d) {
+	soup_socket_disconnect(d);
+	g_object_unref(d);
+	return FALSE;
+}
+
+void
+dropped(SoupMessage *msg, gpointer d) {
+	drops++;
+	g_timeout_add(100, dropconn, d);
+}
+
+/* starts surf on the file name of the server */
+void
+fetch(const char *name) {
+	char *argv[] = { surf, NULL, NULL };
+
+	argv[1] = g_strdup_printf("http://127.0.0.1:%u/%s", port, name);
+	if(!g_spawn_async(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+				NULL, NULL, &pid, NULL)) {
+		fprintf(stderr, "rangetest: cannot run %s\n", surf);
+		exit(EXIT_FAILURE);
+	}
+	g_free(argv[1]);
+}
+
+/* file.bin honours ranges, plain.bin answers every request with 200 */
+void
+serve(SoupServer *srv, SoupMessage *msg, const char *path,
+		GHashTable *q, SoupClientContext *cl, gpointer d) {
+	int n;
+	goffset len;
+	SoupRange *r;
+
+	if(strcmp(msg->method, "GET") && strcmp(msg->method, "HEAD")) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+		return;
+	}
+	soup_message_headers_set_content_type(msg->response_headers,
+			"application/octet-stream", NULL);
+	soup_message_headers_replace(msg->response_headers,
+			"Content-Disposition", "attachment");
+	soup_message_headers_replace(msg->response_headers, "ETag", "\"1\"");
+	if(soup_message_headers_get(msg->request_headers, "Range"))
+		ranges++;
+	if(!g_str_has_suffix(path, "/file.bin")
+			|| !soup_message_headers_get_ranges(msg->request_headers,
+				SIZE, &r, &n)) {
+		soup_message_set_status(msg, SOUP_STATUS_OK);
+		soup_message_body_append(msg->response_body, SOUP_MEMORY_STATIC,
+				body, SIZE);
+		return;
+	}
+	if(r[0].start == 0)
+		fromzero++;
+	len = r[0].end - r[0].start + 1;
+	soup_message_set_status(msg, SOUP_STATUS_PARTIAL_CONTENT);
+	soup_message_headers_set_content_range(msg->response_headers,
+			r[0].start, r[0].end, SIZE);
+	if(breaking && len > CHUNK) {
+		/* announce the whole range, send a part and hang up */
+		soup_message_headers_set_content_length(msg->response_headers, len);
+		soup_message_body_append(msg->response_body, SOUP_MEMORY_STATIC,
+				body + r[0].start, CHUNK);
+		g_signal_connect(msg, "wrote-chunk", G_CALLBACK(dropped),
+				g_object_ref(soup_client_context_get_socket(cl)));
+	}
+	else
+		soup_message_body_append(msg->response_body, SOUP_MEMORY_STATIC,
+				body + r[0].start, len);
+	soup_message_headers_free_ranges(msg->request_headers, r);
+}
+
+/* runs the server until no request came for secs seconds */
+void
+settle(int secs) {
+	int last, quiet;
+
+	for(quiet = 0; quiet < secs * 100; quiet++) {
+		last = ranges + drops;
+		while(g_main_context_iteration(NULL, FALSE));
+		g_usleep(10000);
+		if(ranges + drops != last)
+			quiet = 0;
+	}
+}
+
+void
+stopsurf(void) {
+	if(!pid)
+		return;
+	kill(pid, SIGTERM);
+	while(waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+	g_spawn_close_pid(pid);
+	pid = 0;
+}
+
+/* runs the server until path exists */
+gboolean
+waitfile(const char *path, int secs) {
+	int i;
+
+	for(i = 0; i < secs * 100; i++) {
+		if(g_file_test(path, G_FILE_TEST_EXISTS))
+			return TRUE;
+		while(g_main_context_iteration(NULL, FALSE));
+		g_usleep(10000);
+	}
+	return FALSE;
+}
+
+int
+main(int argc, char *argv[]) {
+	int i;
+	gsize len;
+	char *data = NULL, *file, *state, *rm[] = { "rm", "-rf", NULL, NULL };
+	SoupServer *srv;
+
+	if(argc != 2) {
+		fputs("usage: rangetest path/to/surf\n", stderr);
+		return EXIT_FAILURE;
+	}
+	g_thread_init(NULL);
+	g_type_init();
+	surf = argv[1];
+	for(i = 0; i < SIZE; i++)
+		body[i] = i * 7 % 251;
+	/* surf keeps its profile and downloads under HOME */
+	home = g_build_filename(g_get_tmp_dir(), "surf-test.XXXXXX", NULL);
+	if(!mkdtemp(home)) {
+		perror("rangetest: mkdtemp");
+		return EXIT_FAILURE;
+	}
+	g_setenv("HOME", home, TRUE);
+	dldir = g_build_filename(home, ".surf", "dl", NULL);
+	srv = soup_server_new(SOUP_SERVER_PORT, 0, NULL);
+	soup_server_add_handler(srv, NULL, serve, NULL, NULL);
+	soup_server_run_async(srv);
+	port = soup_server_get_port(srv);
+	file = g_build_filename(dldir, "file.bin", NULL);
+	state = g_strconcat(file, ".state", NULL);
+
+	/* a download from scratch is split into segments */
+	ranges = fromzero = 0;
+	fetch("split/file.bin");
+	check(waitfile(file, 30), "split download finished");
+	stopsurf();
+	check(ranges > 1, "split download used several ranges");
+	check(g_file_get_contents(file, &data, &len, NULL)
+			&& len == SIZE && !memcmp(data, body, SIZE),
+			"split download is intact");
+	g_free(data);
+	data = NULL;
+	unlink(file);
+
+	/* every range breaks off, the next surf resumes from the state */
+	ranges = fromzero = drops = 0;
+	breaking = TRUE;
+	fetch("resume/file.bin");
+	check(waitfile(state, 30), "interrupted download saved its state");
+	settle(2);
+	check(drops > 1, "interrupted download had its ranges broken");
+	stopsurf();
+	check(!g_file_test(file, G_FILE_TEST_EXISTS),
+			"interrupted download is not complete");
+	ranges = fromzero = 0;
+	breaking = FALSE;
+	fetch("resume/file.bin");
+	check(waitfile(file, 30), "resumed download finished");
+	stopsurf();
+	check(ranges > 0 && !fromzero, "resumed download skipped fetched bytes");
+	check(g_file_get_contents(file, &data, &len, NULL)
+			&& len == SIZE && !memcmp(data, body, SIZE),
+			"resumed download is intact");
+	g_free(data);
+	data = NULL;
+	unlink(file);
+
+	/* a 200 to the first range leaves one stream */
+	ranges = 0;
+	g_free(file);
+	file = g_build_filename(dldir, "plain.bin", NULL);
+	fetch("plain/plain.bin");
+	check(waitfile(file, 30), "download without ranges finished");
+	stopsurf();
+	check(ranges == 1, "download without ranges used one request");
+	check(g_file_get_contents(file, &data, &len, NULL)
+			&& len == SIZE && !memcmp(data, body, SIZE),
+			"download without ranges is intact");
+	g_free(data);
+
+	rm[2] = home;
+	g_spawn_sync(NULL, rm, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL,
+			NULL, NULL, NULL, NULL);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}